@@ -1,418 +1,4196 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
 #include <curl/curl.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+/* USDT probes, for `perf record -e 'sdt_async_tui:*'` (after
+ * `perf buildid-cache --add <binary>`) or bpftrace. Each one is a single nop
+ * until it's traced, and they're compiled out entirely without systemtap's
+ * sdt.h. The probes are:
+ *   request(url_len)                      a URL was entered at the prompt
+ *   transfer__start(id, url_len)          a network thread started fetching it
+ *   chunk(id, len, size)                  data arrived, `size` in total so far
+ *   transfer__done(id, status, size, us)  a transfer finished, after `us`
+ *   redraw__start()
+ *   redraw__end(frame_bytes)              the frame was written out
+ * `id` being the response's id in the store */
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE(provider, name)
+#define DTRACE_PROBE1(provider, name, a1) ((void)sizeof(a1))
+#define DTRACE_PROBE2(provider, name, a1, a2)                                  \
+  ((void)sizeof(a1), (void)sizeof(a2))
+#define DTRACE_PROBE3(provider, name, a1, a2, a3)                              \
+  ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+#define DTRACE_PROBE4(provider, name, a1, a2, a3, a4)                          \
+  ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3), (void)sizeof(a4))
+#endif
 
 void *network_thread(void *);
 
-int notify_fd;
 
-void notify_main(void) {
-  int ret = write(notify_fd, &(char){'\0'}, 1);
-  assert(ret == 1);
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Output for a single frame is composed into this buffer, and then submitted
+ * to the terminal with a single write(). The buffer is reused across frames,
+ * so it only has to grow when the terminal does */
+struct frame {
+  char *data;
+  size_t len;
+  size_t capacity;
+  /* Totals across all frames, reported on exit */
+  size_t n_frames;
+  size_t n_bytes;
+  size_t n_writes;
+  size_t max_bytes;
+};
+
+static void frame_append(struct frame *frame, const char *data, size_t len) {
+  if (frame->len + len > frame->capacity) {
+    size_t capacity = frame->capacity ? frame->capacity : 4096;
+
+    while (capacity < frame->len + len) {
+      capacity *= 2;
+    }
+
+    char *ptr = realloc(frame->data, capacity);
+    assert(ptr);
+
+    frame->data = ptr;
+    frame->capacity = capacity;
+  }
+
+  memcpy(&frame->data[frame->len], data, len);
+  frame->len += len;
+}
+
+static void frame_flush(struct frame *frame) {
+  for (size_t written = 0; written < frame->len;) {
+    ssize_t ret = write(STDOUT_FILENO, &frame->data[written],
+                        frame->len - written);
+
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
+
+    assert(ret > 0);
+
+    written += ret;
+    frame->n_writes++;
+  }
+
+  frame->n_frames++;
+  frame->n_bytes += frame->len;
+  frame->max_bytes =
+      frame->len > frame->max_bytes ? frame->len : frame->max_bytes;
+
+  frame->len = 0;
 }
-void sigwinch_handler(int sig) { notify_main(); }
 
-void term_clear(void) { printf("\x1b[H\033[2J"); }
+void term_clear(struct frame *frame) {
+  frame_append(frame, "\x1b[H\033[2J", 7);
+}
 /* This escape sequence moves the cursor to the relevant y and x co-ordinates
  * so that we can print the output. Example usage:
- *   term_set_cursor(1, 1); // Shift to the first column of the first row
- *   printf("Hello from (1, 1)!");
+ *   term_set_cursor(frame, 1, 1); // Shift to the first column of the first row
+ *   frame_append(frame, "Hello from (1, 1)!", 18);
  */
-void term_set_cursor(int y, int x) { printf("\x1b[%d;%dH", y, x); }
+void term_set_cursor(struct frame *frame, int y, int x) {
+  char seq[32];
+  int len = snprintf(seq, sizeof(seq), "\x1b[%d;%dH", y, x);
+
+  frame_append(frame, seq, len);
+}
 
 struct wsize {
   int rows;
   int cols;
 };
 
+/* Model of the terminal's contents, letting redraw() compose a frame in
+ * memory and only send the cells that changed since the last frame instead of
+ * clearing and repainting everything. Each cell holds one UTF-8 encoded
+ * character, packed into an integer with the first byte in the lowest bits */
+struct screen {
+  int rows;
+  int cols;
+  /* The frame being composed */
+  uint32_t *cells;
+  /* What's currently displayed on the terminal */
+  uint32_t *shown;
+  /* Set when we don't know what's displayed (startup or resize) */
+  bool invalid;
+  /* Scratch space for copying out a line of text that fits on the screen */
+  char *line;
+};
+
+/* Response bodies are stored as a list of fixed size chunks rather than one
+ * contiguous buffer, so that appending to them never has to move the data
+ * received so far. This matches the largest chunk curl hands to write_cb */
+#define CHUNK_SIZE (16 * 1024)
+/* Maximum number of free chunks kept around for reuse */
+#define CHUNK_POOL_MAX 256
+
+/* Free chunks go back here instead of to malloc(), as the network thread
+ * allocates them at a high rate. The free list is threaded through the first
+ * bytes of the chunks themselves */
+static struct {
+  pthread_mutex_t lock;
+  void *free;
+  size_t n_free;
+} chunk_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static char *chunk_alloc(void) {
+  pthread_mutex_lock(&chunk_pool.lock);
+
+  void *chunk = chunk_pool.free;
+
+  if (chunk) {
+    chunk_pool.free = *(void **)chunk;
+    chunk_pool.n_free--;
+  }
+
+  pthread_mutex_unlock(&chunk_pool.lock);
+
+  if (!chunk) {
+    chunk = malloc(CHUNK_SIZE);
+    assert(chunk);
+  }
+
+  return chunk;
+}
+
+static void chunk_free(char *chunk) {
+  pthread_mutex_lock(&chunk_pool.lock);
+
+  if (chunk_pool.n_free < CHUNK_POOL_MAX) {
+    *(void **)chunk = chunk_pool.free;
+    chunk_pool.free = chunk;
+    chunk_pool.n_free++;
+    chunk = NULL;
+  }
+
+  pthread_mutex_unlock(&chunk_pool.lock);
+
+  free(chunk);
+}
+
+static void chunk_pool_cleanup(void) {
+  while (chunk_pool.free) {
+    void *next = *(void **)chunk_pool.free;
+
+    free(chunk_pool.free);
+    chunk_pool.free = next;
+  }
+
+  chunk_pool.n_free = 0;
+}
+
+/* Maximum length of a URL (including the NUL terminator), same as the
+ * prompt's buffer */
+#define URL_MAX 128
+
+/* Long enough for the host part of any URL we can fetch */
+#define HOST_MAX 64
+
+/* Breakdown of a finished transfer, as reported by curl. The times are in
+ * microseconds since the start of the transfer, each phase ending at it's
+ * time: DNS, TCP and TLS (`appconnect`, 0 without TLS) are done when the
+ * connection is, `pretransfer` is when the request is about to be sent, and
+ * `starttransfer` is when the first byte of the response arrived */
+struct transfer_timing {
+  curl_off_t namelookup;
+  curl_off_t connect;
+  curl_off_t appconnect;
+  curl_off_t pretransfer;
+  curl_off_t starttransfer;
+  curl_off_t total;
+  /* Body bytes on the wire, and after decoding */
+  curl_off_t wire_bytes;
+  size_t decoded_bytes;
+  /* 0 if no response was received. For a body served from the HTTP cache,
+   * the status of the cached response rather than the 304 */
+  long status;
+  /* Set if the server answered with a 304 and the cached body was served */
+  bool revalidated;
+  CURLcode result;
+  char host[HOST_MAX];
+};
+
 struct curl_response {
-  char *response;
+  /* The body, `size` bytes split across `n_chunks` chunks */
+  char **chunks;
+  size_t n_chunks;
+  size_t chunks_capacity;
   size_t size;
+  /* Offsets of every '\n' in the body, appended to by write_cb as the data
+   * arrives so that redraw() can jump straight to any line */
+  size_t *newlines;
+  size_t n_newlines;
+  size_t newlines_capacity;
+  /* The above are private to write_cb, except that the `chunks` and
+   * `newlines` arrays are only ever reallocated with the store's lock held.
+   * The number of bytes and newlines it has finished writing are published
+   * here (with release ordering) for the main thread to display while the
+   * transfer is still in progress */
+  _Atomic size_t committed;
+  _Atomic size_t committed_newlines;
+  /* Once the body outgrows the store's spill threshold, it's moved out of
+   * `chunks` into this unlinked file and appended to with write()s. It's
+   * read with pread() while the transfer is in progress, and through `map`
+   * (a read-only mapping of the whole file) once it's done. The newline
+   * index is then a shared mapping of `newlines_fd`, grown (and so moved)
+   * with the store's lock held just like when it's on the heap */
+  bool spilled;
+  /* Set if spilling failed (no space left, say), the body then stays in
+   * memory rather than being copied out again on every write */
+  bool spill_failed;
+  int fd;
+  int newlines_fd;
+  const char *map;
+  /* Chunks (of a finished, in-memory response) that the main thread has
+   * compressed while they were far from the viewport. If it's entry here is
+   * non-zero, a chunk has been replaced by a zlib stream of that many bytes.
+   * Only the first `n_packed` chunks have been looked at so far, and `saved`
+   * is the number of bytes that freed up */
+  uint32_t *packed;
+  size_t n_packed;
+  size_t saved;
+  /* Snapshot of the above taken by store_sync(), this is what's displayed */
+  size_t view_size;
+  size_t view_newlines;
+  /* Number of lines this response currently has in the store's tree */
+  size_t tree_lines;
+  /* Set by the network thread once the transfer has finished, along with
+   * `timing` right before it */
+  _Atomic bool done;
+  struct transfer_timing timing;
+  /* Assigned by the response store */
+  size_t id;
+  struct response_store *store;
+  /* Taken from the request */
+  size_t seq;
+  char url[URL_MAX];
 };
 
-struct global_state {
-  /* Used to communicate the URL to be fetched to the Network thread
-   * Written to by the main thread, and read by the Network thread */ 
-  int pipe[2];
-  /* Used to wake up the main thread to resize on SIGWINCH
-   * or display new data received by the network thread
-   * No actual data is transmitted over this pipe, only a dummy byte
-   * is written to it to wake up the main thread's poll() syscall, making it
-   * redraw the UI instantly */
-  int notify_ui_pipe[2];
-  /* Number of lines to skip while printing (from the bottom) */
-  int scroll;
-  /* Checked by the network thread to determine when to exit */
-  _Atomic bool done;
-  /* The libCURL handle used by the network thread to perform requests */
-  CURLM *multi;
-  pthread_t network_thread;
-  /* This is a shared buffer (fixed size, for simplicity) that the Network
-   * thread writes to, and the main thread reads from to display the TUI
-   * `latest_response` is an index into the `responses` array, indicating
-   * how many requests have been performed so far, and the corresponding data
-   * is stored in `responses` */
-  /* The flow goes something like this:
-   *   main_thread -> pipe -> network_thread -> curl
-   *   curl_response -> responses -> notify main thread
-   * The network thread fetches the requested URL, stores it's contents in
-   * the first unused index in `responses`, and once the request is finished,
-   * increments `latest_response` to indicate that the new response is ready to
-   * be displayed by the main thread */
-  struct {
-    struct curl_response responses[1024];
-    _Atomic size_t latest_response;
-  } buffer;
+/* Growable store of responses, addressed by a monotonically increasing id
+ * (the order in which the transfers were started). Once the finished
+ * responses take up more than `budget` bytes of memory (or the spilled ones
+ * more than `disk_budget` bytes of disk), the oldest ones are evicted.
+ * The live ids are [first, latest_response), stored in `slots` starting at
+ * the id `base`. Evicted or not yet compacted ids have a NULL slot */
+struct response_store {
+  /* Guards all of the below, the network thread holds it while adding or
+   * evicting responses, and the main thread while reading them */
+  pthread_mutex_t lock;
+  struct curl_response **slots;
+  size_t capacity;
+  size_t base;
+  size_t first;
+  _Atomic size_t latest_response;
+  /* Bytes of memory taken up by the bodies of all finished responses */
+  size_t bytes;
+  size_t budget;
+  /* Same for the temporary files of the spilled ones. These usually live
+   * on a tmpfs, so they need a limit of their own */
+  size_t disk_bytes;
+  size_t disk_budget;
+  /* Set in batch mode, where responses are never evicted, but freed once
+   * they've been written out */
+  bool pinned;
+  /* Size above which a response's body is spilled to disk */
+  size_t spill_threshold;
+  /* Fenwick tree (1-indexed) over the line counts of the responses in
+   * `slots`, letting redraw() map a scroll offset to the response and line
+   * it lands on in O(log n) rather than walking every line above it */
+  size_t *line_tree;
+  /* Total number of lines across all responses */
+  size_t n_lines;
+  /* Responses whose transfers are still in progress, their line counts are
+   * brought up to date by store_sync() before every frame */
+  struct curl_response **active;
+  size_t n_active;
+  size_t active_capacity;
+  /* Set by write_cb whenever it commits new data, so that the network thread
+   * can tell the main thread to redraw */
+  _Atomic bool progress;
 };
 
-static size_t write_cb(void *data, size_t size, size_t nmemb, void *clientp) {
-  size_t realsize = size * nmemb;
-  struct curl_response *mem = (struct curl_response *)clientp;
+enum engine {
+  ENGINE_POLL,
+  ENGINE_EPOLL,
+};
 
-  char *ptr = realloc(mem->response, mem->size + realsize + 1);
-  assert(ptr);
+/* How requests are distributed across the network threads */
+enum distribution {
+  DISTRIBUTE_HOST,
+  DISTRIBUTE_LEAST_LOADED,
+};
 
-  mem->response = ptr;
-  memcpy(&(mem->response[mem->size]), data, realsize);
-  mem->size += realsize;
-  mem->response[mem->size] = 0;
+struct options {
+  /* Maximum number of transfers that each network thread runs concurrently */
+  int max_in_flight;
+  /* Number of network threads */
+  int n_workers;
+  /* Connection limits of each network thread, per host and in total. 0 means
+   * unlimited */
+  int max_host_connections;
+  int max_connections;
+  enum distribution distribution;
+  /* Memory budget for the response store, in bytes */
+  size_t budget;
+  /* Size above which a response is spilled to disk, in bytes */
+  size_t spill_threshold;
+  /* Disk budget for the spilled responses, in bytes */
+  size_t disk_budget;
+  /* Maximum number of frames drawn per second */
+  int max_fps;
+  /* How the network threads wait on their transfers */
+  enum engine engine;
+  /* File that DNS results and TLS sessions are persisted to, NULL if none */
+  const char *cache_path;
+  /* File that the trace is written to on exit, NULL if tracing is disabled */
+  const char *trace_path;
+  /* File listing the URLs to fetch without a UI ("-" for stdin), NULL to run
+   * the TUI */
+  const char *batch_path;
+  /* Precede each body written out in batch mode with a header */
+  bool framed;
+  /* Directory of the HTTP cache, NULL if disabled */
+  const char *http_cache_dir;
+};
 
-  return realsize;
-}
+/* How long the UI must have been idle before cold responses are compacted,
+ * in nanoseconds */
+#define COMPACT_IDLE 1000000000
+/* Responses within this many lines of the viewport aren't compacted */
+#define COMPACT_DISTANCE 4096
+/* Chunks compressed per step, so that we get back to input promptly */
+#define COMPACT_BATCH 16
 
-/* The first fd on a pipe is for reading, and the other is for writing */
-enum {
-  READ_END = 0,
-  WRITE_END = 1,
+/* Compresses the chunks of finished responses far away from the viewport
+ * whenever the UI is idle, see compact_step() */
+struct compactor {
+  /* Cleared once a step finds nothing to compact, and set again by anything
+   * that could change that (new responses, scrolling, resizing) */
+  bool pending;
+  /* CLOCK_MONOTONIC timestamp, in nanoseconds */
+  uint64_t last_activity;
 };
 
-/* Tagged Unions for the utterly deranged */
-struct pipe_event {
-  char *url;
+/* Limits how often the UI is redrawn. Changes (keystrokes, notifications,
+ * resizes) mark the UI as dirty, and everything that arrives before the next
+ * frame is due is coalesced into that one frame */
+struct redraw_scheduler {
+  bool dirty;
+  /* CLOCK_MONOTONIC timestamps, in nanoseconds */
+  uint64_t last_frame;
+  uint64_t interval;
 };
 
-void make_term_raw(struct termios *original_tios) {
-  struct termios raw;
+/* Latencies are bucketed log-linearly, HdrHistogram style: every power of two
+ * is split into 2^LATENCY_SUB_BITS equal buckets, so a value is known to
+ * within ~3% at any magnitude, in a fixed amount of memory */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+/* Enough for any number of microseconds that fits in 40 bits (~12 days) */
+#define LATENCY_BUCKETS ((40 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
 
-  /* Get the current parameters/attributes */
-  tcgetattr(STDIN_FILENO, &raw);
+/* Time from a keystroke being read to the frame showing it being written to
+ * the terminal, in microseconds */
+struct latency_histogram {
+  uint64_t counts[LATENCY_BUCKETS];
+  uint64_t n;
+  uint64_t max;
+};
 
-  /* Save the terminal attributes to restore the terminal to a sane state
-   * on cleanup */
-  memcpy(original_tios, &raw, sizeof(raw));
+static size_t latency_bucket(uint64_t value) {
+  if (value < LATENCY_SUB) {
+    return value;
+  }
 
-  cfmakeraw(&raw);
+  int exp = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+  size_t bucket = (exp + 1) * LATENCY_SUB + (value >> exp) - LATENCY_SUB;
 
-  /* Allow read() to return only after reading 1 character */
-  raw.c_cc[VMIN] = 1;
-  /* Disable timeouts for read(), allowing it to block until a character is entered */
-  raw.c_cc[VTIME] = 0;
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
 
-  /* TCSAFLUSH pushes the changes after all pending output has been written */
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+/* The largest value that falls into `bucket` */
+static uint64_t latency_bucket_max(size_t bucket) {
+  if (bucket < LATENCY_SUB) {
+    return bucket;
+  }
 
-  /* Switch to a secondary "screen", allowing us to control the scrollback
-   * independently of the terminal in use */
-  printf("\033[?1049h\033[22;0;0t");
-  fflush(stdout);
-}
+  int exp = bucket / LATENCY_SUB - 1;
+  uint64_t mantissa = bucket % LATENCY_SUB + LATENCY_SUB;
 
-void restore_term(struct termios *original_tios) {
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, original_tios);
+  return ((mantissa + 1) << exp) - 1;
+}
 
-  /* Switch back to the original terminal scrollback/screen */
-  printf("\033[?1049l\033[23;0;0t");
-  fflush(stdout);
+static void latency_record(struct latency_histogram *histogram,
+                           uint64_t value) {
+  histogram->counts[latency_bucket(value)]++;
+  histogram->n++;
+  histogram->max = value > histogram->max ? value : histogram->max;
 }
 
-struct wsize get_win_size(void) {
-  struct winsize ws;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+/* Returns the value (rounded up to it's bucket) that `percentile` percent of
+ * the recorded values are at or below */
+static uint64_t latency_percentile(const struct latency_histogram *histogram,
+                                   double percentile) {
+  uint64_t rank = (uint64_t)(percentile / 100 * histogram->n + 0.5);
+  rank = rank > 0 ? rank : 1;
 
-  return (struct wsize){.rows = ws.ws_row, .cols = ws.ws_col};
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += histogram->counts[i];
+
+    if (seen >= rank) {
+      uint64_t value = latency_bucket_max(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+
+  return histogram->max;
 }
 
-void init_state(struct global_state *state) {
-  curl_global_init(CURL_GLOBAL_ALL);
+/* Must be a power of two */
+#define QUEUE_SIZE 256
 
-  *state = (struct global_state){
-      .multi = curl_multi_init(),
-  };
+/* A URL to fetch, on it's way from the prompt to a network thread */
+struct request {
+  char url[URL_MAX];
+  /* When it was entered, CLOCK_MONOTONIC in nanoseconds */
+  uint64_t queued_at;
+  /* Number of requests sent before it */
+  size_t seq;
+};
 
-  pipe(state->pipe);
-  pipe(state->notify_ui_pipe);
+/* Bounded single-producer (main thread), single-consumer (network thread)
+ * ring of URLs to fetch. The URLs are stored inline, so submitting one costs
+ * no allocations, and no syscalls unless the network thread is asleep */
+struct request_queue {
+  struct request requests[QUEUE_SIZE];
+  /* Only advanced by the producer and the consumer respectively, each on it's
+   * own cache line so that they don't keep stealing it from each other */
+  _Alignas(64) _Atomic size_t head;
+  _Alignas(64) _Atomic size_t tail;
+  /* Set by the network thread while it's (about to be) blocked in
+   * curl_multi_poll() waiting for new requests, meaning that the producer
+   * must wake it up */
+  _Alignas(64) _Atomic bool parked;
+};
 
-  fcntl(state->pipe[READ_END], F_SETFL, O_NONBLOCK);
+/* Requests that didn't fit in the queue (say, a large paste) are held here by
+ * the main thread, and moved into the queue as the network thread frees up
+ * space in it. A ring buffer that grows as needed */
+struct request_backlog {
+  struct request *requests;
+  size_t head;
+  size_t len;
+  size_t capacity;
+  /* Number of requests ever sent */
+  size_t n_sent;
+};
 
-  pthread_create(&state->network_thread, NULL, &network_thread, state);
-}
+/* Events recorded by a thread before the rest are dropped, so that leaving
+ * tracing on doesn't eat up all the memory. ~32 MiB per thread */
+#define TRACE_MAX_EVENTS (1 << 20)
 
-void cleanup_state(struct global_state *state) {
-  state->done = true;
-  curl_multi_wakeup(state->multi);
+enum trace_phase {
+  /* A span on the thread's own track */
+  TRACE_COMPLETE,
+  /* A point in time on the thread's track */
+  TRACE_INSTANT,
+  /* Start and end of a span on the track of a request, as those overlap */
+  TRACE_BEGIN,
+  TRACE_END,
+  /* A point in time on the track of a request */
+  TRACE_MARK,
+};
 
-  pthread_join(state->network_thread, NULL);
+struct trace_event {
+  /* Always a string literal */
+  const char *name;
+  enum trace_phase phase;
+  /* Response id, for the request tracks */
+  size_t id;
+  /* CLOCK_MONOTONIC timestamps, in nanoseconds */
+  uint64_t ts;
+  uint64_t dur;
+  /* Shown as the event's "value" argument, if non-zero */
+  uint64_t value;
+};
 
-  /* Drain any unused events not consumed from the pipe due to premature
-   * exit requested by Ctrl + C */
-  for (;;) {
-    struct pipe_event ev;
-    int ret = read(state->pipe[READ_END], &ev, sizeof(ev));
+/* Events recorded by a single thread. Only ever touched by it's owner while
+ * it runs, and read by cleanup_state() once every thread has been joined, so
+ * recording an event is just an append */
+struct trace_buffer {
+  struct trace_event *events;
+  size_t len;
+  size_t capacity;
+  size_t dropped;
+};
 
-    /* If no data is there, errno would be set to EWOULDBLOCK as read() would
-     * have to wait until data is written, meaning that the pipe is already
-     * drained */
-    if (ret == -1 && errno == EWOULDBLOCK) {
-      break;
-    }
+/* The calling thread's buffer, NULL if tracing is disabled */
+static _Thread_local struct trace_buffer *trace_local;
+
+static void trace_event(enum trace_phase phase, const char *name, size_t id,
+                        uint64_t ts, uint64_t dur, uint64_t value) {
+  struct trace_buffer *trace = trace_local;
 
-    assert(ret == sizeof(ev));
-    free(ev.url);
+  if (!trace) {
+    return;
   }
 
-  close(state->pipe[READ_END]);
-  close(state->pipe[WRITE_END]);
+  if (trace->len == trace->capacity) {
+    if (trace->capacity == TRACE_MAX_EVENTS) {
+      trace->dropped++;
+      return;
+    }
 
-  close(state->notify_ui_pipe[READ_END]);
-  close(state->notify_ui_pipe[WRITE_END]);
+    size_t capacity = trace->capacity ? trace->capacity * 2 : 4096;
+    capacity = capacity < TRACE_MAX_EVENTS ? capacity : TRACE_MAX_EVENTS;
 
-  curl_multi_cleanup(state->multi);
-  curl_global_cleanup();
+    struct trace_event *events =
+        realloc(trace->events, capacity * sizeof(*events));
+    assert(events);
 
-  for (size_t i = 0; i < 1024; i++) {
-    free(state->buffer.responses[i].response);
+    trace->events = events;
+    trace->capacity = capacity;
   }
+
+  trace->events[trace->len++] = (struct trace_event){
+      .name = name,
+      .phase = phase,
+      .id = id,
+      .ts = ts,
+      .dur = dur,
+      .value = value,
+  };
 }
 
-void *network_thread(void *arg) {
-  struct global_state *state = arg;
+/* Records a span from `start` until now on the thread's track */
+static void trace_complete(const char *name, uint64_t start, uint64_t value) {
+  if (trace_local) {
+    trace_event(TRACE_COMPLETE, name, 0, start, now_ns() - start, value);
+  }
+}
 
-  CURL *easy = curl_easy_init();
-  assert(easy);
+static void trace_instant(const char *name) {
+  if (trace_local) {
+    trace_event(TRACE_INSTANT, name, 0, now_ns(), 0, 0);
+  }
+}
 
-  struct curl_response chunk = {0};
+/* Records a span from `start` to `end` on the track of request `id` */
+static void trace_span(const char *name, size_t id, uint64_t start,
+                       uint64_t end) {
+  trace_event(TRACE_BEGIN, name, id, start, 0, 0);
+  trace_event(TRACE_END, name, id, end, 0, 0);
+}
 
-  int prev_running_handles = -1;
+/* Each network thread performs it's share of the transfers with it's own
+ * multi handle, so that the work of all the transfers (TLS, decompression,
+ * etc.) is spread across cores */
+struct network_worker {
+  /* Used to communicate the URLs to be fetched to the Network thread
+   * Written to by the main thread, and read by the Network thread */
+  struct request_queue queue;
+  /* eventfd that the network thread waits on alongside it's transfers, written
+   * to for new requests (only if it's parked) and on exit */
+  int wake_fd;
+  /* The libCURL handle used by the network thread to perform requests */
+  CURLM *multi;
+  pthread_t thread;
+  /* Number of requests queued or in progress. Incremented by the main thread
+   * when it submits one, and decremented by the network thread when it
+   * finishes */
+  _Atomic int load;
+  struct trace_buffer trace;
+  struct global_state *state;
+};
 
-  while (!state->done) {
-    int running_handles;
+/* DNS cache, TLS sessions and (with a single network thread) connections
+ * shared across every easy handle, so that repeat requests to a host skip
+ * the lookup and handshakes regardless of which handle or thread performs
+ * them. curl calls back into us to lock each kind of data separately */
+struct share {
+  CURLSH *handle;
+  pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
 
-    CURLMcode code = curl_multi_perform(state->multi, &running_handles);
+/* Long enough for any address printed by curl, including IPv6 ones */
+#define ADDR_MAX 64
+/* How long a resolved address is reused across runs. curl doesn't tell us
+ * the TTLs of the DNS records themselves */
+#define DNS_CACHE_TTL (60 * 60)
 
-    if (code != CURLM_OK) {
-      break;
-    }
+/* Address that a host was last connected to */
+struct dns_entry {
+  char host[URL_MAX];
+  long port;
+  char addr[ADDR_MAX];
+  /* Wall clock time after which the host is looked up again */
+  time_t expires;
+};
 
-    struct curl_waitfd pipe_waiter = {.fd = state->pipe[READ_END],
-                                      .events = CURL_WAIT_POLLIN};
+/* Optional file carrying the DNS results (and, if libcurl can export them,
+ * TLS sessions) of one run over to the next, so that the first request to a
+ * host we hit every session doesn't have to start cold. It's loaded by
+ * init_state (the DNS entries going into the share with the first transfer),
+ * and written back by cleanup_state */
+struct disk_cache {
+  /* NULL if disabled */
+  const char *path;
+  /* Guards everything below, the network threads update `dns` as transfers
+   * finish */
+  pthread_mutex_t lock;
+  struct dns_entry *dns;
+  size_t n_dns;
+  size_t dns_capacity;
+  /* The unexpired entries loaded from the file, in CURLOPT_RESOLVE form.
+   * Handed to the first transfer that starts (and thus loaded into the
+   * shared DNS cache once), NULL after that */
+  struct curl_slist *resolve;
+  /* Removals ("-host:port") of the hosts that we failed to connect to from
+   * the shared DNS cache, handed to the next transfer that starts */
+  struct curl_slist *purge;
+};
 
-    /* A transfer completed/failed */
-    if (prev_running_handles == 1 && running_handles == 0) {
-      if (++state->buffer.latest_response == 1024) {
-        assert(!"Max responses filled!");
-      }
+/* Number of finished transfers listed in the stats overlay */
+#define STATS_RECENT 8
+/* Number of most recent transfers per host that percentiles are taken over */
+#define STATS_WINDOW 256
+/* Hosts tracked at once, the least recently used one is replaced */
+#define STATS_HOSTS 32
 
-      notify_main();
-    }
+struct host_stats {
+  char host[HOST_MAX];
+  /* Ring of total times, in microseconds */
+  curl_off_t totals[STATS_WINDOW];
+  /* Number of transfers ever added */
+  size_t n_totals;
+  uint64_t last_used;
+};
 
-    int ret = curl_multi_poll(state->multi, &pipe_waiter, 1, 10000, &(int){0});
+/* Timings of the finished transfers, added to by the network threads and
+ * displayed by the stats overlay. Kept apart from the responses, so that
+ * they outlive eviction */
+struct transfer_stats {
+  pthread_mutex_t lock;
+  /* Ring of the most recent transfers */
+  struct transfer_timing recent[STATS_RECENT];
+  size_t n_recent;
+  struct host_stats hosts[STATS_HOSTS];
+  size_t n_hosts;
+  uint64_t clock;
+};
 
-    if (ret != CURLM_OK) {
-      break;
+struct global_state {
+  /* The network threads, along with everything used to talk to them */
+  struct network_worker *workers;
+  struct share share;
+  struct disk_cache cache;
+  /* eventfd used to wake up the main thread to display new data received by
+   * the network thread, making it redraw the UI instantly. Being a counter
+   * rather than a stream of bytes, any number of notifications are consumed
+   * by a single read() */
+  int notify_fd;
+  /* Set while a notification is pending on `notify_fd`, so that a burst of
+   * them costs a single write() and results in a single redraw */
+  _Atomic bool notify_pending;
+  /* signalfd delivering SIGWINCH, for resizing */
+  int signal_fd;
+  /* Number of lines to skip while printing (from the bottom) */
+  int scroll;
+  /* Toggled with Ctrl + T */
+  bool show_stats;
+  /* When the oldest keystroke not yet on screen was read, 0 if none */
+  uint64_t input_at;
+  struct latency_histogram latency;
+  /* Only touched by the main thread */
+  struct screen screen;
+  struct frame frame;
+  struct redraw_scheduler scheduler;
+  struct request_backlog backlog;
+  struct compactor compactor;
+  /* Checked by the network threads to determine when to exit */
+  _Atomic bool done;
+  /* Body bytes of the finished transfers as they came over the wire, and
+   * after decoding their Content-Encoding */
+  _Atomic uint64_t wire_bytes;
+  _Atomic uint64_t decoded_bytes;
+  struct transfer_stats stats;
+  /* The main thread's trace, and when tracing started. Timestamps in the
+   * trace file are relative to the latter */
+  struct trace_buffer trace;
+  uint64_t trace_epoch;
+  struct options opts;
+  /* This is a shared buffer that the Network threads write to, and the main
+   * thread reads from to display the TUI
+   * `latest_response` is the id that'll be given to the next response,
+   * indicating how many requests have been started so far */
+  /* The flow goes something like this:
+   *   main_thread -> worker's queue -> network_thread -> curl
+   *   curl_response -> buffer -> notify main thread
+   * A network thread adds a new response to `buffer` for every transfer it
+   * starts (incrementing `latest_response`), stores the fetched contents in
+   * it, and once that transfer is finished, sets `done` on the response to
+   * indicate that it's ready to be displayed by the main thread. Transfers run
+   * concurrently, so responses can finish out of order */
+  struct response_store buffer;
+};
+
+/* Opens an unlinked temporary file for a response to be spilled to */
+static int open_tmpfile(void) {
+  const char *dir = getenv("TMPDIR");
+  dir = dir ? dir : "/tmp";
+
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+  /* Not every filesystem supports O_TMPFILE */
+  if (fd == -1) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/async_tui.XXXXXX", dir);
+
+    fd = mkstemp(path);
+
+    if (fd != -1) {
+      unlink(path);
     }
+  }
 
-    /* We only perform one request at a time here for simplicitly,
-     * but still prefer the curl_multi_poll API as that allows us to
-     * nearly instantly interrupt the transfer and cleanup on Ctrl + C */
-    if (running_handles == 0 && pipe_waiter.revents & CURL_WAIT_POLLIN) {
-      struct pipe_event read_event;
+  return fd;
+}
 
-      int ret = read(state->pipe[READ_END], &read_event, sizeof(read_event));
-      assert(ret == sizeof(read_event));
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, data, len);
 
-      curl_multi_remove_handle(state->multi, easy);
-      curl_easy_setopt(easy, CURLOPT_URL, read_event.url);
-      curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_cb);
-      curl_easy_setopt(easy, CURLOPT_WRITEDATA,
-                       &state->buffer.responses[state->buffer.latest_response]);
-      curl_multi_add_handle(state->multi, easy);
+    if (ret == -1 && errno == EINTR) {
+      continue;
+    }
 
-      free(read_event.url);
+    if (ret <= 0) {
+      return false;
     }
 
-    prev_running_handles = running_handles;
+    data += ret;
+    len -= ret;
   }
 
-  if (!state->done) {
-    assert(!"CURL returned failure without being interrupted!");
+  return true;
+}
+
+/* (Re)maps the newline index of a spilled response from `fd` with room for
+ * `capacity` newlines. The blocks are allocated up front, so that running out
+ * of disk space is an error here rather than a SIGBUS when writing to the
+ * mapping */
+static size_t *map_newlines(int fd, size_t *old, size_t old_capacity,
+                            size_t capacity) {
+  size_t len = capacity * sizeof(*old);
+
+  if (fallocate(fd, 0, 0, len) != 0) {
+    return NULL;
   }
 
-  curl_multi_remove_handle(state->multi, easy);
-  curl_easy_cleanup(easy);
+  void *newlines =
+      old ? mremap(old, old_capacity * sizeof(*old), len, MREMAP_MAYMOVE)
+          : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
-  pthread_exit(NULL);
+  return newlines != MAP_FAILED ? newlines : NULL;
 }
 
-void send_request(struct global_state *state, char *buf) {
-  struct pipe_event event = {
-      .url = strdup(buf),
-  };
+/* Moves the body and the newline index of a response out to temporary
+ * files once it outgrows the store's spill threshold, so that no single
+ * response can take up an unbounded amount of memory. The files count
+ * towards the store's disk budget rather than it's memory budget (but a
+ * tmpfs keeps them in memory all the same). Returns false (leaving the
+ * response in memory) if we couldn't */
+static bool resp_spill(struct curl_response *resp) {
+  int fd = open_tmpfile();
+  int newlines_fd = open_tmpfile();
 
-  /* If the structure was larger and we wanted this to be more efficient,
-   * we could allocate the struct on the heap, cast the pointer to uintptr_t
-   * and pass it over the pipe */
-  int ret = write(state->pipe[WRITE_END], &event, sizeof(event));
-  assert(ret == sizeof(event));
+  bool ok = fd != -1 && newlines_fd != -1;
 
-  /* Wake up the reader */
-  curl_multi_wakeup(state->multi);
-}
+  for (size_t i = 0; i < resp->n_chunks && ok; i++) {
+    size_t left = resp->size - i * CHUNK_SIZE;
+    ok = write_all(fd, resp->chunks[i], left < CHUNK_SIZE ? left : CHUNK_SIZE);
+  }
 
-static void read_char(struct global_state *state, char buf[128], char c) {
-  size_t len = strlen(buf);
+  size_t capacity = resp->newlines_capacity ? resp->newlines_capacity : 64;
+  size_t *newlines = ok ? map_newlines(newlines_fd, NULL, 0, capacity) : NULL;
 
-  switch (c) {
-  /* Newline */
-  case '\r':
-    send_request(state, buf);
-    memset(buf, 0, 128);
-    break;
-  /* Backspace */
-  case 127:
-  case '\b':
-    if (len > 0) {
-      buf[len - 1] = '\0';
+  if (!newlines) {
+    if (fd != -1) {
+      close(fd);
     }
-    break;
-  /* Double quote scrolls down */
-  case '"':
-    state->scroll--;
-    break;
-  /* Single quote scrolls down */
-  case '\'':
-    state->scroll++;
-    break;
-  default:
-    if ((len + 1) < 128 && isprint(c)) {
-      buf[len] = c;
+
+    if (newlines_fd != -1) {
+      close(newlines_fd);
     }
+
+    return false;
   }
-}
 
-static void redraw(struct global_state *state, char *buf) {
-  struct wsize size = get_win_size();
+  if (resp->n_newlines) {
+    memcpy(newlines, resp->newlines, resp->n_newlines * sizeof(*newlines));
+  }
 
-  term_clear();
+  /* The main thread might be reading the body or the index */
+  pthread_mutex_lock(&resp->store->lock);
 
-  int y = size.rows - 1;
+  for (size_t i = 0; i < resp->n_chunks; i++) {
+    chunk_free(resp->chunks[i]);
+  }
 
-  /* Skip N lines from the bottom to provide a scrolling effect */
-  int n_skip = state->scroll;
+  free(resp->chunks);
+  free(resp->newlines);
 
-  for (size_t i = state->buffer.latest_response; i > 0; i--) {
-    struct curl_response *resp = &state->buffer.responses[i - 1];
+  resp->chunks = NULL;
+  resp->n_chunks = 0;
+  resp->chunks_capacity = 0;
+  resp->newlines = newlines;
+  resp->newlines_capacity = capacity;
+  resp->fd = fd;
+  resp->newlines_fd = newlines_fd;
+  resp->spilled = true;
 
-    /* Failed request */
-    if (!resp->response) {
-      continue;
-    }
+  pthread_mutex_unlock(&resp->store->lock);
 
-    for (size_t index = resp->size; index > 0; index--) {
-      size_t start = index - 1;
+  return true;
+}
 
-      if (start == 0 || resp->response[start - 1] == '\n') {
-        if (y <= 0) {
-          break;
-        }
+/* Appends to the body of an in-memory response */
+static void append_chunks(struct curl_response *mem, const char *data,
+                          size_t len) {
+  for (size_t copied = 0; copied < len;) {
+    size_t pos = mem->size + copied;
+    size_t in_chunk = pos % CHUNK_SIZE;
 
-        if (n_skip-- > 0) {
-          continue;
-        }
+    /* The last chunk is full (or there are no chunks yet) */
+    if (in_chunk == 0 && pos == mem->n_chunks * CHUNK_SIZE) {
+      if (mem->n_chunks == mem->chunks_capacity) {
+        size_t capacity = mem->chunks_capacity ? 2 * mem->chunks_capacity : 4;
 
-        char *begin = &resp->response[start];
-        char *newline = strchr(begin, '\n');
+        pthread_mutex_lock(&mem->store->lock);
 
-        newline = newline ? newline : &resp->response[resp->size];
+        char **chunks = realloc(mem->chunks, capacity * sizeof(*chunks));
+        assert(chunks);
 
-        /* Begin printing at the corresponding y and x co-ordinates */
-        term_set_cursor(y--, 1);
+        mem->chunks = chunks;
+        mem->chunks_capacity = capacity;
 
-        for (size_t i = 0; begin != (newline + 1) && i < size.cols;
-             i++, begin++) {
-          putchar(*begin == '\t' ? ' ' : *begin);
-        }
+        pthread_mutex_unlock(&mem->store->lock);
       }
+
+      mem->chunks[mem->n_chunks++] = chunk_alloc();
     }
-  }
 
-  term_set_cursor(size.rows, 1);
-  printf("%.*s", size.cols, buf);
+    size_t n = CHUNK_SIZE - in_chunk;
+    n = n < len - copied ? n : len - copied;
 
-  fflush(stdout);
+    memcpy(&mem->chunks[mem->n_chunks - 1][in_chunk], data + copied, n);
+    copied += n;
+  }
 }
 
-int main(void) {
-  struct global_state state;
-  init_state(&state);
+/* Indexes the newlines in `len` bytes of new data, which start at offset
+ * `mem->size` of the body. memchr() is vectorized, so this is much cheaper
+ * than looking at every byte ourselves */
+static bool index_newlines(struct curl_response *mem, const char *data,
+                           size_t len) {
+  const char *end = data + len;
 
-  struct termios original_tios;
-  make_term_raw(&original_tios);
+  for (const char *nl = data; (nl = memchr(nl, '\n', end - nl)); nl++) {
+    if (mem->n_newlines == mem->newlines_capacity) {
+      size_t capacity =
+          mem->newlines_capacity ? 2 * mem->newlines_capacity : 64;
 
-  notify_fd = state.notify_ui_pipe[WRITE_END];
-  sigaction(SIGWINCH,
-            &(struct sigaction){
-                .sa_handler = &sigwinch_handler,
-            },
-            NULL);
+      pthread_mutex_lock(&mem->store->lock);
 
-  char buf[128] = {0};
+      size_t *newlines;
 
-  for (;;) {
-    redraw(&state, buf);
+      if (mem->spilled) {
+        newlines = map_newlines(mem->newlines_fd, mem->newlines,
+                                mem->newlines_capacity, capacity);
+      } else {
+        newlines = realloc(mem->newlines, capacity * sizeof(*newlines));
+        assert(newlines);
+      }
 
-    struct pollfd fds[] = {
-        {.fd = STDIN_FILENO, .events = POLL_IN},
-        {.fd = state.notify_ui_pipe[READ_END], .events = POLL_IN}};
+      if (newlines) {
+        mem->newlines = newlines;
+        mem->newlines_capacity = capacity;
+      }
 
-    poll(fds, 2, -1);
+      pthread_mutex_unlock(&mem->store->lock);
 
-    if (fds[0].revents & POLL_IN) {
-      char c;
+      if (!newlines) {
+        return false;
+      }
+    }
 
-      int ret = read(STDIN_FILENO, &c, 1);
-      assert(ret == 1);
+    mem->newlines[mem->n_newlines++] = mem->size + (nl - data);
+  }
 
-      /* Ctrl + C */
-      if (c == 3) {
-        break;
-      }
+  return true;
+}
 
-      read_char(&state, buf, c);
-    }
+static size_t write_cb(void *data, size_t size, size_t nmemb, void *clientp) {
+  size_t realsize = size * nmemb;
+  struct curl_response *mem = (struct curl_response *)clientp;
 
-    /* SIGWINCH received or new data recevied */
-    if (fds[1].revents & POLL_IN) {
-      /* Nothing to do -- just redraw
-       * We read() the pipe here to empty it to prevent poll() from returning
-       * instantly as there would be unread data on the pipe, causing an
-       * expensive infinite loop */
-      int ret = read(state.notify_ui_pipe[READ_END], &(char){'\0'}, 1);
-      assert(ret == 1);
+  if (!mem->spilled && !mem->spill_failed &&
+      mem->size + realsize > mem->store->spill_threshold) {
+    mem->spill_failed = !resp_spill(mem);
+  }
+
+  /* Returning less than `realsize` fails the transfer, which is all we can
+   * do once the disk is full */
+  if (!index_newlines(mem, data, realsize)) {
+    return 0;
+  }
+
+  if (mem->spilled) {
+    if (!write_all(mem->fd, data, realsize)) {
+      return 0;
     }
+  } else {
+    append_chunks(mem, data, realsize);
   }
 
-  restore_term(&original_tios);
-  cleanup_state(&state);
+  mem->size += realsize;
+
+  /* Newlines first, see store_sync() */
+  atomic_store_explicit(&mem->committed_newlines, mem->n_newlines,
+                        memory_order_release);
+  atomic_store_explicit(&mem->committed, mem->size, memory_order_release);
+  atomic_store_explicit(&mem->store->progress, true, memory_order_relaxed);
+
+  if (mem->size == realsize && trace_local) {
+    trace_event(TRACE_MARK, "first byte", mem->id, now_ns(), 0, 0);
+  }
+
+  DTRACE_PROBE3(async_tui, chunk, mem->id, realsize, mem->size);
+
+  return realsize;
+}
+
+/* Compressed chunks are decompressed (whole) into this cache when they're
+ * read, so scrolling through one doesn't decompress it's chunks over and
+ * over */
+#define UNPACKED_CACHE_SIZE 64
+
+struct unpacked_chunk {
+  /* Response id and chunk index, responses are never looked up through the
+   * cache, so it's fine for one to be evicted while it's chunks are here */
+  size_t id;
+  size_t chunk;
+  char *data;
+  uint64_t last_used;
+};
+
+/* State for compressing chunks and reading them back, only used by the main
+ * thread (with the store's lock held, as the chunks belong to it) */
+static struct {
+  z_stream deflate;
+  bool deflate_ready;
+  /* Compressed output, before it's copied into a buffer of the right size */
+  unsigned char *scratch;
+  size_t scratch_len;
+  /* Least recently used entries are replaced */
+  struct unpacked_chunk cache[UNPACKED_CACHE_SIZE];
+  uint64_t clock;
+} packer;
+
+static size_t chunk_len(struct curl_response *resp, size_t idx) {
+  size_t left = resp->size - idx * CHUNK_SIZE;
+  return left < CHUNK_SIZE ? left : CHUNK_SIZE;
+}
+
+static const char *unpack_chunk(struct curl_response *resp, size_t idx) {
+  struct unpacked_chunk *victim = &packer.cache[0];
+
+  for (size_t i = 0; i < UNPACKED_CACHE_SIZE; i++) {
+    struct unpacked_chunk *entry = &packer.cache[i];
+
+    if (entry->data && entry->id == resp->id && entry->chunk == idx) {
+      entry->last_used = ++packer.clock;
+      return entry->data;
+    }
+
+    if (entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+
+  if (!victim->data) {
+    victim->data = malloc(CHUNK_SIZE);
+    assert(victim->data);
+  }
+
+  uLongf len = CHUNK_SIZE;
+
+  int ret = uncompress((Bytef *)victim->data, &len,
+                       (Bytef *)resp->chunks[idx], resp->packed[idx]);
+  assert(ret == Z_OK && len == chunk_len(resp, idx));
+
+  victim->id = resp->id;
+  victim->chunk = idx;
+  victim->last_used = ++packer.clock;
+
+  return victim->data;
+}
+
+/* Compresses a chunk of a finished response, unless that doesn't save at
+ * least a quarter of it. Must be called with the store's lock held */
+static void pack_chunk(struct response_store *store,
+                       struct curl_response *resp, size_t idx) {
+  if (!packer.deflate_ready) {
+    /* Level 1, compaction has to stay cheap enough to run on the main
+     * thread without getting in the way of input */
+    int ret = deflateInit(&packer.deflate, 1);
+    assert(ret == Z_OK);
+
+    packer.deflate_ready = true;
+    packer.scratch_len = deflateBound(&packer.deflate, CHUNK_SIZE);
+    packer.scratch = malloc(packer.scratch_len);
+    assert(packer.scratch);
+  }
+
+  if (!resp->packed) {
+    resp->packed = calloc(resp->n_chunks, sizeof(*resp->packed));
+    assert(resp->packed);
+  }
+
+  size_t len = chunk_len(resp, idx);
+  z_stream *stream = &packer.deflate;
+
+  deflateReset(stream);
+
+  stream->next_in = (Bytef *)resp->chunks[idx];
+  stream->avail_in = len;
+  stream->next_out = packer.scratch;
+  stream->avail_out = packer.scratch_len;
+
+  int ret = deflate(stream, Z_FINISH);
+  assert(ret == Z_STREAM_END);
+
+  size_t packed_len = stream->total_out;
+
+  if (packed_len > len - len / 4) {
+    return;
+  }
+
+  char *packed = malloc(packed_len);
+  assert(packed);
+
+  memcpy(packed, packer.scratch, packed_len);
+  chunk_free(resp->chunks[idx]);
+
+  resp->chunks[idx] = packed;
+  resp->packed[idx] = packed_len;
+  resp->saved += CHUNK_SIZE - packed_len;
+  store->bytes -= CHUNK_SIZE - packed_len;
+}
+
+static void packer_cleanup(void) {
+  if (packer.deflate_ready) {
+    deflateEnd(&packer.deflate);
+  }
+
+  free(packer.scratch);
+
+  for (size_t i = 0; i < UNPACKED_CACHE_SIZE; i++) {
+    free(packer.cache[i].data);
+  }
+}
+
+/* Copies `len` bytes of the body starting at `offset`, which must all have
+ * been written already. Unless called by the network thread writing the
+ * response, the store's lock must be held */
+static void resp_read(struct curl_response *resp, size_t offset, char *dst,
+                      size_t len) {
+  if (resp->map) {
+    memcpy(dst, &resp->map[offset], len);
+    return;
+  }
+
+  if (resp->spilled) {
+    while (len > 0) {
+      ssize_t ret = pread(resp->fd, dst, len, offset);
+
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+
+      /* The data was written before we could see it, so this can only
+       * fail due to an I/O error */
+      assert(ret > 0);
+
+      dst += ret;
+      offset += ret;
+      len -= ret;
+    }
+
+    return;
+  }
+
+  while (len > 0) {
+    size_t in_chunk = offset % CHUNK_SIZE;
+    size_t n = CHUNK_SIZE - in_chunk;
+    n = n < len ? n : len;
+
+    size_t idx = offset / CHUNK_SIZE;
+    const char *chunk = resp->packed && resp->packed[idx]
+                            ? unpack_chunk(resp, idx)
+                            : resp->chunks[idx];
+
+    memcpy(dst, &chunk[in_chunk], n);
+
+    dst += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+/* Maps the body of a finished spilled response for reading, the newline
+ * index is already mapped. In-memory responses instead give back the slack
+ * in their newline index, as it's not going to grow anymore. Must be called
+ * with the store's lock held */
+static void resp_seal(struct curl_response *resp) {
+  if (!resp->spilled) {
+    if (resp->n_newlines > 0 && resp->n_newlines < resp->newlines_capacity) {
+      size_t *newlines =
+          realloc(resp->newlines, resp->n_newlines * sizeof(*newlines));
+      assert(newlines);
+
+      resp->newlines = newlines;
+      resp->newlines_capacity = resp->n_newlines;
+    }
+
+    return;
+  }
+
+  if (resp->size > 0) {
+    void *map = mmap(NULL, resp->size, PROT_READ, MAP_SHARED, resp->fd, 0);
+
+    /* If it fails, pread() keeps working */
+    if (map != MAP_FAILED) {
+      resp->map = map;
+    }
+  }
+
+  /* Neither file is going to grow anymore, so the descriptors are only
+   * needed if mapping failed */
+  if (resp->map) {
+    close(resp->fd);
+    resp->fd = -1;
+  }
+
+  close(resp->newlines_fd);
+  resp->newlines_fd = -1;
+}
+
+static size_t resp_line_count(struct curl_response *resp) {
+  if (resp->view_size == 0) {
+    return 0;
+  }
+
+  return resp->view_newlines +
+         (resp->view_newlines == 0 ||
+          resp->newlines[resp->view_newlines - 1] != resp->view_size - 1);
+}
+
+/* Copies at most `max` bytes of the `line`th line (excluding the newline)
+ * into `dst`, returning the number of bytes copied */
+static size_t resp_line(struct curl_response *resp, size_t line, char *dst,
+                        size_t max) {
+  size_t start = line > 0 ? resp->newlines[line - 1] + 1 : 0;
+  size_t end =
+      line < resp->view_newlines ? resp->newlines[line] : resp->view_size;
+  size_t len = end - start < max ? end - start : max;
+
+  resp_read(resp, start, dst, len);
+
+  return len;
+}
+
+/* Memory accounted for against the store's budget, spilled responses are
+ * accounted for against the disk budget instead */
+static size_t resp_bytes(struct curl_response *resp) {
+  if (resp->spilled) {
+    return 0;
+  }
+
+  return resp->n_chunks * CHUNK_SIZE - resp->saved +
+         resp->newlines_capacity * sizeof(*resp->newlines);
+}
+
+/* Size of the temporary files of a spilled response */
+static size_t resp_disk_bytes(struct curl_response *resp) {
+  if (!resp->spilled) {
+    return 0;
+  }
+
+  return resp->size + resp->newlines_capacity * sizeof(*resp->newlines);
+}
+
+/* Whether the finished responses take up more than either budget allows.
+ * Must be called with the lock held */
+static bool store_over_budget(struct response_store *store) {
+  return store->bytes > store->budget ||
+         store->disk_bytes > store->disk_budget;
+}
+
+static void store_init(struct response_store *store, size_t budget,
+                       size_t disk_budget, size_t spill_threshold) {
+  *store = (struct response_store){
+      .lock = PTHREAD_MUTEX_INITIALIZER,
+      .capacity = 64,
+      .budget = budget,
+      .disk_budget = disk_budget,
+      .spill_threshold = spill_threshold,
+  };
+
+  store->slots = calloc(store->capacity, sizeof(*store->slots));
+  store->line_tree = calloc(store->capacity + 1, sizeof(*store->line_tree));
+  assert(store->slots && store->line_tree);
+}
+
+/* Adds `delta` lines to the response at position `pos` in `slots`. Removals
+ * rely on unsigned wraparound */
+static void tree_add(struct response_store *store, size_t pos, size_t delta) {
+  for (size_t i = pos + 1; i <= store->capacity; i += i & -i) {
+    store->line_tree[i] += delta;
+  }
+}
+
+/* Finds the position in `slots` of the response containing the `line`th line
+ * (counting from the oldest line in the store), replacing `line` with the
+ * index of that line within the response. `line` must be < `n_lines` */
+static size_t tree_find(struct response_store *store, size_t *line) {
+  size_t pos = 0;
+
+  /* `capacity` is always a power of two */
+  for (size_t mask = store->capacity; mask > 0; mask >>= 1) {
+    if (pos + mask <= store->capacity &&
+        store->line_tree[pos + mask] <= *line) {
+      pos += mask;
+      *line -= store->line_tree[pos];
+    }
+  }
+
+  return pos;
+}
+
+/* Rebuilds the tree in O(n) after `slots` was moved around or resized */
+static void tree_rebuild(struct response_store *store) {
+  size_t *tree = calloc(store->capacity + 1, sizeof(*tree));
+  assert(tree);
+
+  for (size_t i = 1; i <= store->capacity; i++) {
+    struct curl_response *resp = store->slots[i - 1];
+
+    if (resp) {
+      tree[i] += resp->tree_lines;
+    }
+
+    size_t parent = i + (i & -i);
+
+    if (parent <= store->capacity) {
+      tree[parent] += tree[i];
+    }
+  }
+
+  free(store->line_tree);
+  store->line_tree = tree;
+}
+
+/* Snapshots the data write_cb has committed so far for display, and brings
+ * it's line count in the tree up to date. Must be called with the lock held */
+static void store_sync(struct response_store *store,
+                       struct curl_response *resp) {
+  /* Pairs with the release stores in write_cb. `committed_newlines` is
+   * published before `committed`, so we have at least every newline in the
+   * first `size` bytes, but possibly some after it from a later write_cb
+   * that we have to leave out */
+  size_t size = atomic_load_explicit(&resp->committed, memory_order_acquire);
+  size_t n_newlines =
+      atomic_load_explicit(&resp->committed_newlines, memory_order_acquire);
+
+  while (n_newlines > 0 && resp->newlines[n_newlines - 1] >= size) {
+    n_newlines--;
+  }
+
+  resp->view_size = size;
+  resp->view_newlines = n_newlines;
+
+  size_t lines = resp_line_count(resp);
+
+  tree_add(store, resp->id - store->base, lines - resp->tree_lines);
+  store->n_lines += lines - resp->tree_lines;
+  resp->tree_lines = lines;
+}
+
+/* Returns NULL for evicted ids. Must be called with the lock held */
+static struct curl_response *store_get(struct response_store *store,
+                                       size_t id) {
+  if (id < store->first || id >= store->latest_response) {
+    return NULL;
+  }
+
+  return store->slots[id - store->base];
+}
+
+/* Adds `resp` to the store, returning it's id. Must be called with the lock
+ * held */
+static size_t store_push(struct response_store *store,
+                         struct curl_response *resp) {
+  if (store->latest_response - store->base == store->capacity) {
+    size_t live = store->latest_response - store->first;
+
+    /* Reuse the space left behind by evicted responses if that frees up at
+     * least half the slots, otherwise grow. This keeps pushes amortized O(1) */
+    if (live <= store->capacity / 2) {
+      memmove(store->slots, &store->slots[store->first - store->base],
+              live * sizeof(*store->slots));
+      memset(&store->slots[live], 0,
+             (store->capacity - live) * sizeof(*store->slots));
+      store->base = store->first;
+    } else {
+      struct curl_response **slots =
+          realloc(store->slots, 2 * store->capacity * sizeof(*slots));
+      assert(slots);
+
+      memset(&slots[store->capacity], 0, store->capacity * sizeof(*slots));
+
+      store->slots = slots;
+      store->capacity *= 2;
+    }
+
+    tree_rebuild(store);
+  }
+
+  store->slots[store->latest_response - store->base] = resp;
+  resp->id = store->latest_response;
+  resp->store = store;
+
+  if (store->n_active == store->active_capacity) {
+    size_t capacity = store->active_capacity ? 2 * store->active_capacity : 16;
+    struct curl_response **active =
+        realloc(store->active, capacity * sizeof(*active));
+    assert(active);
+
+    store->active = active;
+    store->active_capacity = capacity;
+  }
+
+  store->active[store->n_active++] = resp;
+
+  return store->latest_response++;
+}
+
+static void free_response(struct curl_response *resp) {
+  for (size_t i = 0; i < resp->n_chunks; i++) {
+    if (resp->packed && resp->packed[i]) {
+      free(resp->chunks[i]);
+    } else {
+      chunk_free(resp->chunks[i]);
+    }
+  }
+
+  free(resp->chunks);
+  free(resp->packed);
+
+  if (resp->spilled) {
+    if (resp->map) {
+      munmap((void *)resp->map, resp->size);
+    }
+
+    if (resp->fd != -1) {
+      close(resp->fd);
+    }
+
+    /* Still open if the transfer never finished */
+    if (resp->newlines_fd != -1) {
+      close(resp->newlines_fd);
+    }
+
+    munmap(resp->newlines, resp->newlines_capacity * sizeof(*resp->newlines));
+  } else {
+    free(resp->newlines);
+  }
+
+  free(resp);
+}
+
+/* Frees the finished response `id`. Must be called with the lock held */
+static void store_evict(struct response_store *store, size_t id) {
+  struct curl_response *old = store->slots[id - store->base];
+
+  store->bytes -= resp_bytes(old);
+  store->disk_bytes -= resp_disk_bytes(old);
+  store->n_lines -= old->tree_lines;
+  store->slots[id - store->base] = NULL;
+
+  tree_add(store, id - store->base, -old->tree_lines);
+
+  free_response(old);
+
+  while (store->first < store->latest_response &&
+         !store->slots[store->first - store->base]) {
+    store->first++;
+  }
+}
+
+/* Marks `resp` as finished, accounting for it's size and evicting the oldest
+ * finished responses (other than `resp` itself) until we're back under the
+ * budget. Must be called with the lock held */
+static void store_finish(struct response_store *store,
+                         struct curl_response *resp) {
+  store_sync(store, resp);
+  resp_seal(resp);
+
+  resp->done = true;
+  store->bytes += resp_bytes(resp);
+  store->disk_bytes += resp_disk_bytes(resp);
+
+  for (size_t i = 0; i < store->n_active; i++) {
+    if (store->active[i] == resp) {
+      store->active[i] = store->active[--store->n_active];
+      break;
+    }
+  }
+
+  for (size_t id = store->first; id < store->latest_response &&
+                                 !store->pinned && store_over_budget(store);
+       id++) {
+    struct curl_response *old = store->slots[id - store->base];
+
+    if (!old || old == resp || !old->done) {
+      continue;
+    }
+
+    /* Only evict what frees up the budget that's exceeded */
+    if (old->spilled ? store->disk_bytes <= store->disk_budget
+                     : store->bytes <= store->budget) {
+      continue;
+    }
+
+    store_evict(store, id);
+  }
+}
+
+/* Called by the network thread after making new data available */
+static void notify_main(struct global_state *state) {
+  if (atomic_exchange(&state->notify_pending, true)) {
+    return;
+  }
+
+  trace_instant("notify");
+
+  int ret = write(state->notify_fd, &(uint64_t){1}, sizeof(uint64_t));
+  assert(ret == sizeof(uint64_t));
+}
+
+/* Wakes up a network thread, making it look at it's queue and `done` */
+static void wake_network(struct network_worker *worker) {
+  int ret = write(worker->wake_fd, &(uint64_t){1}, sizeof(uint64_t));
+  assert(ret == sizeof(uint64_t));
+}
+
+/* Returns true if the network thread asked for a redraw */
+static bool consume_notify(struct global_state *state) {
+  uint64_t count;
+
+  if (read(state->notify_fd, &count, sizeof(count)) != sizeof(count)) {
+    return false;
+  }
+
+  /* Only cleared after the counter was reset, otherwise a notification sent
+   * in between would skip the write() and never wake us up. The exchange
+   * also synchronizes with the network thread, making all data published
+   * before the notification visible */
+  atomic_exchange(&state->notify_pending, false);
+
+  trace_instant("notified");
+
+  return true;
+}
+
+/* Returns false if the queue is full */
+static bool queue_push(struct request_queue *queue,
+                       const struct request *request) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) ==
+      QUEUE_SIZE) {
+    return false;
+  }
+
+  queue->requests[head % QUEUE_SIZE] = *request;
+
+  /* Sequentially consistent (rather than just a release) so that it's
+   * ordered before the producer's subsequent load of `parked`, pairing with
+   * the consumer storing `parked` before checking if the queue is empty.
+   * Either the consumer sees the new URL, or we see that it's parked */
+  atomic_store(&queue->head, head + 1);
+
+  return true;
+}
+
+/* Returns the oldest request in the queue, or NULL if it's empty. It stays
+ * valid until queue_pop() is called */
+static const struct request *queue_peek(struct request_queue *queue) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+  if (tail == atomic_load(&queue->head)) {
+    return NULL;
+  }
+
+  return &queue->requests[tail % QUEUE_SIZE];
+}
+
+static void queue_pop(struct request_queue *queue) {
+  atomic_fetch_add_explicit(&queue->tail, 1, memory_order_release);
+}
+
+void make_term_raw(struct termios *original_tios) {
+  struct termios raw;
+
+  /* Get the current parameters/attributes */
+  tcgetattr(STDIN_FILENO, &raw);
+
+  /* Save the terminal attributes to restore the terminal to a sane state
+   * on cleanup */
+  memcpy(original_tios, &raw, sizeof(raw));
+
+  cfmakeraw(&raw);
+
+  /* Allow read() to return only after reading 1 character */
+  raw.c_cc[VMIN] = 1;
+  /* Disable timeouts for read(), allowing it to block until a character is entered */
+  raw.c_cc[VTIME] = 0;
+
+  /* TCSAFLUSH pushes the changes after all pending output has been written */
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+  /* Switch to a secondary "screen", allowing us to control the scrollback
+   * independently of the terminal in use */
+  printf("\033[?1049h\033[22;0;0t");
+  fflush(stdout);
+}
+
+void restore_term(struct termios *original_tios) {
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, original_tios);
+
+  /* Switch back to the original terminal scrollback/screen */
+  printf("\033[?1049l\033[23;0;0t");
+  fflush(stdout);
+}
+
+struct wsize get_win_size(void) {
+  struct winsize ws;
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+
+  return (struct wsize){.rows = ws.ws_row, .cols = ws.ws_col};
+}
+
+/* Resizes the screen if needed, and blanks out the frame being composed */
+static void screen_begin(struct screen *screen, struct wsize size) {
+  if (screen->rows != size.rows || screen->cols != size.cols) {
+    size_t n = (size_t)size.rows * size.cols;
+
+    free(screen->cells);
+    free(screen->shown);
+    free(screen->line);
+
+    screen->cells = malloc(n * sizeof(*screen->cells));
+    screen->shown = malloc(n * sizeof(*screen->shown));
+    /* Every cell takes up at most 4 bytes of UTF-8 */
+    screen->line = malloc(4 * size.cols);
+    assert(screen->cells && screen->shown && screen->line);
+
+    screen->rows = size.rows;
+    screen->cols = size.cols;
+    screen->invalid = true;
+  }
+
+  for (int i = 0; i < screen->rows * screen->cols; i++) {
+    screen->cells[i] = ' ';
+  }
+}
+
+/* Writes `len` bytes of `text` to the `y`th row (0-indexed) of the frame,
+ * truncating it to the width of the screen */
+static void screen_put(struct screen *screen, int y, const char *text,
+                       size_t len) {
+  uint32_t *row = &screen->cells[y * screen->cols];
+
+  for (int x = 0; len > 0 && x < screen->cols; x++) {
+    unsigned char c = *text;
+
+    /* Length of the UTF-8 sequence from the leading byte */
+    size_t n = c < 0x80           ? 1
+               : (c >> 5) == 0x6  ? 2
+               : (c >> 4) == 0xe  ? 3
+               : (c >> 3) == 0x1e ? 4
+                                  : 1;
+    n = n > len ? len : n;
+
+    uint32_t cell = 0;
+
+    for (size_t i = n; i > 0; i--) {
+      cell = cell << 8 | (unsigned char)text[i - 1];
+    }
+
+    /* Tabs and other control characters would mess with the cursor position
+     * we assume the terminal to be at */
+    row[x] = (c < ' ' || c == 127) ? ' ' : cell;
+
+    text += n;
+    len -= n;
+  }
+}
+
+static void put_cell(struct frame *frame, uint32_t cell) {
+  char bytes[4];
+  size_t len = 0;
+
+  for (; cell; cell >>= 8) {
+    bytes[len++] = cell & 0xff;
+  }
+
+  frame_append(frame, bytes, len);
+}
+
+/* Appends the cells that differ from what's displayed to `frame`, and then
+ * moves the cursor to `y`, `x` (1-indexed, like term_set_cursor) */
+static void screen_flush(struct screen *screen, struct frame *frame, int y,
+                         int x) {
+  if (screen->invalid) {
+    term_clear(frame);
+
+    for (int i = 0; i < screen->rows * screen->cols; i++) {
+      screen->shown[i] = ' ';
+    }
+
+    screen->invalid = false;
+  }
+
+  for (int row = 0; row < screen->rows; row++) {
+    uint32_t *cells = &screen->cells[row * screen->cols];
+    uint32_t *shown = &screen->shown[row * screen->cols];
+
+    for (int col = 0; col < screen->cols;) {
+      if (cells[col] == shown[col]) {
+        col++;
+        continue;
+      }
+
+      /* Extend the run over short stretches of unchanged cells, as repeating
+       * them is cheaper than the escape sequence for moving the cursor */
+      int last = col;
+
+      for (int end = col + 1; end < screen->cols && end - last <= 8; end++) {
+        if (cells[end] != shown[end]) {
+          last = end;
+        }
+      }
+
+      term_set_cursor(frame, row + 1, col + 1);
+
+      for (; col <= last; col++) {
+        put_cell(frame, cells[col]);
+      }
+    }
+  }
+
+  memcpy(screen->shown, screen->cells,
+         (size_t)screen->rows * screen->cols * sizeof(*screen->cells));
+
+  term_set_cursor(frame, y, x);
+}
+
+static void share_lock(CURL *easy, curl_lock_data data,
+                       curl_lock_access access, void *userptr) {
+  struct share *share = userptr;
+  pthread_mutex_lock(&share->locks[data]);
+}
+
+static void share_unlock(CURL *easy, curl_lock_data data, void *userptr) {
+  struct share *share = userptr;
+  pthread_mutex_unlock(&share->locks[data]);
+}
+
+static void share_init(struct share *share, int n_workers) {
+  share->handle = curl_share_init();
+  assert(share->handle);
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&share->locks[i], NULL);
+  }
+
+  curl_share_setopt(share->handle, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share->handle, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share->handle, CURLSHOPT_USERDATA, share);
+
+  curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+  /* curl doesn't support using shared connections from multiple threads at
+   * once. Each multi handle already pools the connections of it's own
+   * transfers anyway, so with multiple network threads connections are only
+   * reused within a thread (which `DISTRIBUTE_HOST` makes the most of) */
+  if (n_workers == 1) {
+    curl_share_setopt(share->handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
+}
+
+static void share_cleanup(struct share *share) {
+  curl_share_cleanup(share->handle);
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_destroy(&share->locks[i]);
+  }
+}
+
+/* Must be called with the cache's lock held, unless there's no network
+ * thread around yet */
+static struct dns_entry *dns_find(struct disk_cache *cache, const char *host,
+                                  long port) {
+  for (size_t i = 0; i < cache->n_dns; i++) {
+    struct dns_entry *entry = &cache->dns[i];
+
+    if (entry->port == port && strcmp(entry->host, host) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static struct dns_entry *dns_append(struct disk_cache *cache) {
+  if (cache->n_dns == cache->dns_capacity) {
+    cache->dns_capacity = cache->dns_capacity ? cache->dns_capacity * 2 : 16;
+    cache->dns = realloc(cache->dns, cache->dns_capacity * sizeof(*cache->dns));
+    assert(cache->dns);
+  }
+
+  return &cache->dns[cache->n_dns++];
+}
+
+/* TLS sessions can only be exported and imported since curl 8.12 */
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static void write_hex(FILE *file, const unsigned char *data, size_t len) {
+  if (len == 0) {
+    fputc('-', file);
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    fprintf(file, "%02x", data[i]);
+  }
+}
+
+/* Decodes `hex` in place, returning the length of the decoded data */
+static size_t read_hex(char *hex) {
+  size_t len = 0;
+
+  if (strcmp(hex, "-") == 0) {
+    return 0;
+  }
+
+  for (; hex[2 * len] && hex[2 * len + 1]; len++) {
+    unsigned byte;
+    sscanf(&hex[2 * len], "%2x", &byte);
+    hex[len] = byte;
+  }
+
+  return len;
+}
+
+/* Line format: tls <valid_until> <shmac> <sdata> <session_key>, the key being
+ * last as it's free-form, and "-" standing in for missing fields */
+static CURLcode export_session(CURL *easy, void *userptr,
+                               const char *session_key,
+                               const unsigned char *shmac, size_t shmac_len,
+                               const unsigned char *sdata, size_t sdata_len,
+                               curl_off_t valid_until, int ietf_tls_id,
+                               const char *alpn, size_t earlydata_max) {
+  FILE *file = userptr;
+
+  fprintf(file, "tls %lld ", (long long)valid_until);
+  write_hex(file, shmac, shmac_len);
+  fputc(' ', file);
+  write_hex(file, sdata, sdata_len);
+  fprintf(file, " %s\n", session_key ? session_key : "-");
+
+  return CURLE_OK;
+}
+
+static void import_session(CURL *easy, char *line, time_t now) {
+  char *save;
+  char *valid_until = strtok_r(line, " ", &save);
+  char *shmac = strtok_r(NULL, " ", &save);
+  char *sdata = strtok_r(NULL, " ", &save);
+  char *session_key = strtok_r(NULL, "", &save);
+
+  if (!session_key || strtoll(valid_until, NULL, 10) <= now) {
+    return;
+  }
+
+  size_t shmac_len = read_hex(shmac);
+  size_t sdata_len = read_hex(sdata);
+
+  curl_easy_ssls_import(easy,
+                        strcmp(session_key, "-") == 0 ? NULL : session_key,
+                        (unsigned char *)shmac, shmac_len,
+                        (unsigned char *)sdata, sdata_len);
+}
+#endif
+
+static void disk_cache_init(struct disk_cache *cache, const char *path) {
+  *cache = (struct disk_cache){.path = path};
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+/* Reads back whatever's still valid from the cache file, TLS sessions going
+ * straight into the share. A missing or unreadable file just means starting
+ * cold */
+static void disk_cache_load(struct disk_cache *cache, struct share *share) {
+  if (!cache->path) {
+    return;
+  }
+
+  FILE *file = fopen(cache->path, "r");
+
+  if (!file) {
+    return;
+  }
+
+  /* Sessions are imported through a handle attached to the share */
+  CURL *easy = curl_easy_init();
+  assert(easy);
+
+  curl_easy_setopt(easy, CURLOPT_SHARE, share->handle);
+
+  time_t now = time(NULL);
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+
+  while (getline(&line, &line_capacity, file) != -1) {
+    line[strcspn(line, "\n")] = '\0';
+
+    long long expires;
+    struct dns_entry entry;
+
+    /* Widths are URL_MAX - 1 and ADDR_MAX - 1 */
+    if (sscanf(line, "dns %lld %127s %ld %63s", &expires, entry.host,
+               &entry.port, entry.addr) == 4) {
+      if (expires <= now || dns_find(cache, entry.host, entry.port)) {
+        continue;
+      }
+
+      entry.expires = expires;
+      *dns_append(cache) = entry;
+
+      /* Added to curl's DNS cache with the usual timeout rather than
+       * permanently ('+'), so hosts are still looked up during a long run.
+       * IPv6 addresses must be bracketed */
+      bool ipv6 = strchr(entry.addr, ':');
+      char resolve[URL_MAX + ADDR_MAX + 32];
+
+      snprintf(resolve, sizeof(resolve), "+%s:%ld:%s%s%s", entry.host,
+               entry.port, ipv6 ? "[" : "", entry.addr, ipv6 ? "]" : "");
+
+      cache->resolve = curl_slist_append(cache->resolve, resolve);
+      assert(cache->resolve);
+    }
+#if LIBCURL_VERSION_NUM >= 0x080c00
+    else if (strncmp(line, "tls ", 4) == 0) {
+      import_session(easy, line + 4, now);
+    }
+#endif
+  }
+
+  free(line);
+  fclose(file);
+
+  curl_easy_cleanup(easy);
+}
+
+/* Remembers the address that the transfer on `easy` connected to, or forgets
+ * the host's entry if connecting failed, in case it went stale */
+static void disk_cache_record(struct disk_cache *cache, CURL *easy,
+                              CURLcode result) {
+  if (!cache->path) {
+    return;
+  }
+
+  char *url;
+  char *addr;
+
+  curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+  curl_easy_getinfo(easy, CURLINFO_PRIMARY_IP, &addr);
+
+  CURLU *parsed = curl_url();
+  assert(parsed);
+
+  char *host = NULL;
+  char *port_str = NULL;
+
+  /* The port is taken from the URL rather than CURLINFO_PRIMARY_PORT, which
+   * is 0 if connecting failed */
+  if (url && curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK) {
+    curl_url_get(parsed, CURLUPART_HOST, &host, 0);
+    curl_url_get(parsed, CURLUPART_PORT, &port_str, CURLU_DEFAULT_PORT);
+  }
+
+  curl_url_cleanup(parsed);
+
+  long port = port_str ? strtol(port_str, NULL, 10) : 0;
+  curl_free(port_str);
+
+  /* Nothing to resolve for IP literals */
+  if (!host || host[0] == '[' || strlen(host) >= URL_MAX ||
+      strcmp(host, addr ? addr : "") == 0) {
+    curl_free(host);
+    return;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+
+  struct dns_entry *entry = dns_find(cache, host, port);
+
+  if (result == CURLE_COULDNT_CONNECT) {
+    if (entry) {
+      *entry = cache->dns[--cache->n_dns];
+    }
+
+    /* The address might have come from the file, in which case curl keeps
+     * using it until it's DNS cache times out unless we remove it */
+    char purge[URL_MAX + 32];
+    snprintf(purge, sizeof(purge), "-%s:%ld", host, port);
+
+    cache->purge = curl_slist_append(cache->purge, purge);
+    assert(cache->purge);
+  } else if (addr && addr[0] && strlen(addr) < ADDR_MAX) {
+    /* The expiry isn't pushed back while the address stays the same, so that
+     * a host is looked up again at least every DNS_CACHE_TTL */
+    if (!entry || strcmp(entry->addr, addr) != 0) {
+      if (!entry) {
+        entry = dns_append(cache);
+      }
+
+      *entry = (struct dns_entry){.port = port,
+                                  .expires = time(NULL) + DNS_CACHE_TTL};
+
+      strcpy(entry->host, host);
+      strcpy(entry->addr, addr);
+    }
+  }
+
+  pthread_mutex_unlock(&cache->lock);
+
+  curl_free(host);
+}
+
+/* Writes the cache out to a temporary file that then replaces the old one, so
+ * that an interrupted write can't leave a truncated cache behind. Must be
+ * called after the network threads are gone, but before the share is */
+static void disk_cache_save(struct disk_cache *cache, struct share *share) {
+  if (!cache->path) {
+    return;
+  }
+
+  size_t tmp_len = strlen(cache->path) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  assert(tmp);
+
+  snprintf(tmp, tmp_len, "%s.tmp", cache->path);
+
+  /* Session tickets are secrets, keep them private */
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  FILE *file = fd != -1 ? fdopen(fd, "w") : NULL;
+
+  if (!file) {
+    fprintf(stderr, "failed to write %s: %s\n", tmp, strerror(errno));
+
+    if (fd != -1) {
+      close(fd);
+    }
+
+    free(tmp);
+    return;
+  }
+
+  time_t now = time(NULL);
+
+  for (size_t i = 0; i < cache->n_dns; i++) {
+    struct dns_entry *entry = &cache->dns[i];
+
+    if (entry->expires > now) {
+      fprintf(file, "dns %lld %s %ld %s\n", (long long)entry->expires,
+              entry->host, entry->port, entry->addr);
+    }
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+  CURL *easy = curl_easy_init();
+  assert(easy);
+
+  curl_easy_setopt(easy, CURLOPT_SHARE, share->handle);
+  curl_easy_ssls_export(easy, export_session, file);
+  curl_easy_cleanup(easy);
+#endif
+
+  if (fclose(file) != 0 || rename(tmp, cache->path) != 0) {
+    fprintf(stderr, "failed to write %s: %s\n", cache->path, strerror(errno));
+    unlink(tmp);
+  }
+
+  free(tmp);
+}
+
+/* Takes the pending changes to the shared DNS cache (if any), which are
+ * applied by curl when the transfer on `easy` starts. The returned list must
+ * be kept around until then */
+static struct curl_slist *disk_cache_resolve(struct disk_cache *cache,
+                                             CURL *easy) {
+  if (!cache->path) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache->lock);
+
+  struct curl_slist *list = cache->resolve;
+
+  /* The purged hosts can't be in the file's entries, as those are only
+   * handed out before the first transfer has even started */
+  for (struct curl_slist *item = cache->purge; item; item = item->next) {
+    list = curl_slist_append(list, item->data);
+    assert(list);
+  }
+
+  curl_slist_free_all(cache->purge);
+
+  cache->resolve = NULL;
+  cache->purge = NULL;
+
+  pthread_mutex_unlock(&cache->lock);
+
+  if (list) {
+    curl_easy_setopt(easy, CURLOPT_RESOLVE, list);
+  }
+
+  return list;
+}
+
+static void disk_cache_cleanup(struct disk_cache *cache) {
+  curl_slist_free_all(cache->resolve);
+  curl_slist_free_all(cache->purge);
+  free(cache->dns);
+  pthread_mutex_destroy(&cache->lock);
+}
+
+void init_state(struct global_state *state, struct options *opts) {
+  curl_global_init(CURL_GLOBAL_ALL);
+
+  *state = (struct global_state){
+      .opts = *opts,
+      .scheduler =
+          {
+              /* Draw the first frame right away */
+              .dirty = true,
+              .interval = 1000000000 / opts->max_fps,
+          },
+  };
+
+  if (opts->trace_path) {
+    state->trace_epoch = now_ns();
+    trace_local = &state->trace;
+  }
+
+  store_init(&state->buffer, opts->budget, opts->disk_budget,
+             opts->spill_threshold);
+  pthread_mutex_init(&state->stats.lock, NULL);
+  share_init(&state->share, opts->n_workers);
+
+  disk_cache_init(&state->cache, opts->cache_path);
+
+  /* Created if it doesn't exist, if that fails nothing is cached */
+  if (opts->http_cache_dir) {
+    mkdir(opts->http_cache_dir, 0700);
+  }
+  disk_cache_load(&state->cache, &state->share);
+
+  state->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  assert(state->notify_fd != -1);
+
+  /* SIGWINCH is blocked (and thus routed to the signalfd instead of a
+   * handler) before the network threads are created, so that they inherit the
+   * signal mask and the signal can't be delivered to them either */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  /* A closed stdout (batch mode writing into `head`, say) fails the write()
+   * with EPIPE instead of killing us, so that we still clean up (and write
+   * out the caches and the trace) on the way out */
+  signal(SIGPIPE, SIG_IGN);
+
+  state->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  assert(state->signal_fd != -1);
+
+  /* Zeroed for the queues' indices, and aligned for their cache lines */
+  state->workers =
+      aligned_alloc(64, opts->n_workers * sizeof(*state->workers));
+  assert(state->workers);
+
+  memset(state->workers, 0, opts->n_workers * sizeof(*state->workers));
+
+  for (int i = 0; i < opts->n_workers; i++) {
+    struct network_worker *worker = &state->workers[i];
+
+    worker->state = state;
+    worker->multi = curl_multi_init();
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(worker->multi && worker->wake_fd != -1);
+
+    /* Concurrent requests to an HTTP/2 origin become streams on a single
+     * connection. Transfers over the limits wait inside curl for a
+     * connection to free up */
+    curl_multi_setopt(worker->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(worker->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      (long)opts->max_host_connections);
+    curl_multi_setopt(worker->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      (long)opts->max_connections);
+
+    pthread_create(&worker->thread, NULL, &network_thread, worker);
+  }
+}
+
+/* Writes out the events of a single thread, as the thread `tid` */
+static void trace_write_thread(FILE *file, struct trace_buffer *trace,
+                               uint64_t epoch, int tid, const char *name) {
+  fprintf(file,
+          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+          "\"args\":{\"name\":\"%s\"}}",
+          tid, name);
+
+  if (trace->dropped > 0) {
+    fprintf(file,
+            ",\n{\"name\":\"dropped events\",\"ph\":\"C\",\"pid\":1,"
+            "\"tid\":%d,\"ts\":0,\"args\":{\"dropped\":%zu}}",
+            tid, trace->dropped);
+  }
+
+  static const char *phases[] = {
+      [TRACE_COMPLETE] = "X", [TRACE_INSTANT] = "i", [TRACE_BEGIN] = "b",
+      [TRACE_END] = "e",      [TRACE_MARK] = "n",
+  };
+
+  for (size_t i = 0; i < trace->len; i++) {
+    struct trace_event *event = &trace->events[i];
+
+    /* In microseconds, which is what the format wants */
+    fprintf(file,
+            ",\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f",
+            event->name, phases[event->phase], tid,
+            (double)(int64_t)(event->ts - epoch) / 1000);
+
+    switch (event->phase) {
+    case TRACE_COMPLETE:
+      fprintf(file, ",\"dur\":%.3f", event->dur / 1000.0);
+      break;
+    case TRACE_INSTANT:
+      fprintf(file, ",\"s\":\"t\"");
+      break;
+    case TRACE_BEGIN:
+    case TRACE_END:
+    case TRACE_MARK:
+      /* Every span of a request ends up on the same track */
+      fprintf(file, ",\"cat\":\"request\",\"id\":%zu", event->id);
+      break;
+    }
+
+    if (event->value) {
+      fprintf(file, ",\"args\":{\"value\":%llu}",
+              (unsigned long long)event->value);
+    }
+
+    fputc('}', file);
+  }
+}
+
+/* Dumps every thread's events as a Chrome trace-event JSON file, which can be
+ * loaded into Perfetto or chrome://tracing. Must only be called once the
+ * network threads have exited */
+static void trace_write(struct global_state *state) {
+  FILE *file = fopen(state->opts.trace_path, "w");
+
+  if (!file) {
+    fprintf(stderr, "failed to write trace to %s: %s\n",
+            state->opts.trace_path, strerror(errno));
+  } else {
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+    trace_write_thread(file, &state->trace, state->trace_epoch, 1, "main");
+
+    for (int i = 0; i < state->opts.n_workers; i++) {
+      char name[32];
+      snprintf(name, sizeof(name), "network %d", i);
+
+      fputs(",\n", file);
+      trace_write_thread(file, &state->workers[i].trace, state->trace_epoch,
+                         i + 2, name);
+    }
+
+    fputs("\n]}\n", file);
+    fclose(file);
+  }
+
+  free(state->trace.events);
+
+  for (int i = 0; i < state->opts.n_workers; i++) {
+    free(state->workers[i].trace.events);
+  }
+
+  trace_local = NULL;
+}
+
+void cleanup_state(struct global_state *state) {
+  state->done = true;
+
+  for (int i = 0; i < state->opts.n_workers; i++) {
+    wake_network(&state->workers[i]);
+  }
+
+  for (int i = 0; i < state->opts.n_workers; i++) {
+    struct network_worker *worker = &state->workers[i];
+
+    pthread_join(worker->thread, NULL);
+
+    close(worker->wake_fd);
+    curl_multi_cleanup(worker->multi);
+  }
+
+  if (state->opts.trace_path) {
+    trace_write(state);
+  }
+
+  free(state->workers);
+
+  disk_cache_save(&state->cache, &state->share);
+  disk_cache_cleanup(&state->cache);
+
+  /* Only after every easy handle using it is gone */
+  share_cleanup(&state->share);
+
+  pthread_mutex_destroy(&state->stats.lock);
+
+  close(state->notify_fd);
+  close(state->signal_fd);
+
+  curl_global_cleanup();
+
+  free(state->screen.cells);
+  free(state->screen.shown);
+  free(state->screen.line);
+  free(state->frame.data);
+  free(state->backlog.requests);
+
+  /* Only the responses that haven't been evicted are left */
+  for (size_t id = state->buffer.first; id < state->buffer.latest_response;
+       id++) {
+    struct curl_response *resp = store_get(&state->buffer, id);
+
+    if (resp) {
+      free_response(resp);
+    }
+  }
+
+  free(state->buffer.slots);
+  free(state->buffer.line_tree);
+  free(state->buffer.active);
+
+  packer_cleanup();
+  chunk_pool_cleanup();
+}
+
+/* FNV-1a hash of the host part of `url` */
+static uint64_t host_hash(const char *url) {
+  const char *host = strstr(url, "://");
+  host = host ? host + 3 : url;
+
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (; *host && !strchr("/:?#", *host); host++) {
+    hash = (hash ^ (unsigned char)tolower(*host)) * 0x100000001b3;
+  }
+
+  return hash;
+}
+
+/* Long enough for any sensible ETag or Last-Modified value, responses with
+ * longer ones just aren't cached */
+#define VALIDATOR_MAX 256
+
+#define HTTP_CACHE_MAGIC "atuihc01"
+
+/* Each file in the HTTP cache directory holds a single response, named after
+ * the hash of it's URL. The header is followed by the URL (to tell apart
+ * URLs with the same hash), the validators, and then the body. Files are
+ * written to a temporary name and renamed into place, so that readers (which
+ * mmap() them) always see a complete one */
+struct http_cache_header {
+  char magic[8];
+  uint32_t url_len;
+  uint32_t etag_len;
+  uint32_t last_modified_len;
+  uint64_t body_len;
+};
+
+/* A pooled easy handle, along with the state of it's current transfer. The
+ * handle's CURLOPT_PRIVATE points back to it */
+struct transfer {
+  CURL *easy;
+  struct curl_response *resp;
+  /* Conditional request headers, if the URL is in the HTTP cache */
+  struct curl_slist *headers;
+  /* Changes to the shared DNS cache made by this transfer, see
+   * disk_cache_resolve() */
+  struct curl_slist *resolve;
+  /* Mapping of the URL's cache file, served as the body on a 304 */
+  void *cached;
+  size_t cached_len;
+  const char *cached_body;
+  size_t cached_body_len;
+  /* Taken from the response's headers */
+  char etag[VALIDATOR_MAX];
+  char last_modified[VALIDATOR_MAX];
+  bool no_store;
+  /* For the trace, see struct request */
+  uint64_t queued_at;
+  uint64_t started_at;
+};
+
+static void http_cache_path(const char *dir, const char *url, char *dst,
+                            size_t max) {
+  uint64_t hash = 0xcbf29ce484222325;
+
+  for (; *url; url++) {
+    hash = (hash ^ (unsigned char)*url) * 0x100000001b3;
+  }
+
+  snprintf(dst, max, "%s/%016llx", dir, (unsigned long long)hash);
+}
+
+/* Maps the cache file for `url`, if there's a valid one, and adds the
+ * headers to revalidate it with */
+static void http_cache_open(struct transfer *transfer, const char *dir,
+                            const char *url) {
+  char path[PATH_MAX];
+  http_cache_path(dir, url, path, sizeof(path));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd == -1) {
+    return;
+  }
+
+  struct stat st;
+  void *map = MAP_FAILED;
+
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct http_cache_header)) {
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  /* The mapping stays valid after closing, and even if the file is replaced
+   * in the meantime */
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return;
+  }
+
+  struct http_cache_header header;
+  memcpy(&header, map, sizeof(header));
+
+  const char *url_start = (char *)map + sizeof(header);
+  const char *etag = url_start + header.url_len;
+  const char *last_modified = etag + header.etag_len;
+  const char *body = last_modified + header.last_modified_len;
+
+  size_t len = sizeof(header) + (uint64_t)header.url_len + header.etag_len +
+               header.last_modified_len;
+
+  if (memcmp(header.magic, HTTP_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.etag_len >= VALIDATOR_MAX ||
+      header.last_modified_len >= VALIDATOR_MAX || len > st.st_size ||
+      header.body_len != st.st_size - len || header.url_len != strlen(url) ||
+      memcmp(url_start, url, header.url_len) != 0) {
+    munmap(map, st.st_size);
+    return;
+  }
+
+  char line[VALIDATOR_MAX + 32];
+
+  if (header.etag_len > 0) {
+    snprintf(line, sizeof(line), "If-None-Match: %.*s", (int)header.etag_len,
+             etag);
+    transfer->headers = curl_slist_append(transfer->headers, line);
+    assert(transfer->headers);
+  }
+
+  if (header.last_modified_len > 0) {
+    snprintf(line, sizeof(line), "If-Modified-Since: %.*s",
+             (int)header.last_modified_len, last_modified);
+    transfer->headers = curl_slist_append(transfer->headers, line);
+    assert(transfer->headers);
+  }
+
+  transfer->cached = map;
+  transfer->cached_len = st.st_size;
+  transfer->cached_body = body;
+  transfer->cached_body_len = header.body_len;
+}
+
+/* Writes out the response of a finished transfer, replacing any previous
+ * version. Failing to is harmless, the URL is just fetched in full next
+ * time */
+static void http_cache_store(struct transfer *transfer, const char *dir,
+                             const char *url) {
+  struct curl_response *resp = transfer->resp;
+
+  char path[PATH_MAX];
+  http_cache_path(dir, url, path, sizeof(path));
+
+  /* Unique, as other network threads might be storing the same URL */
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+  int fd = mkstemp(tmp);
+
+  if (fd == -1) {
+    return;
+  }
+
+  struct http_cache_header header = {
+      .url_len = strlen(url),
+      .etag_len = strlen(transfer->etag),
+      .last_modified_len = strlen(transfer->last_modified),
+      .body_len = resp->size,
+  };
+
+  memcpy(header.magic, HTTP_CACHE_MAGIC, sizeof(header.magic));
+
+  struct iovec iov[] = {
+      {&header, sizeof(header)},
+      {(void *)url, header.url_len},
+      {transfer->etag, header.etag_len},
+      {transfer->last_modified, header.last_modified_len},
+  };
+
+  size_t len = sizeof(header) + header.url_len + header.etag_len +
+               header.last_modified_len;
+
+  /* Short writes are treated as failures rather than resumed, they only
+   * happen when the disk is full anyway */
+  bool ok = writev(fd, iov, sizeof(iov) / sizeof(*iov)) == (ssize_t)len;
+
+  char buf[CHUNK_SIZE];
+
+  for (size_t offset = 0; offset < resp->size && ok; offset += len) {
+    size_t left = resp->size - offset;
+    len = left < sizeof(buf) ? left : sizeof(buf);
+
+    resp_read(resp, offset, buf, len);
+    ok = write(fd, buf, len) == (ssize_t)len;
+  }
+
+  if (close(fd) != 0 || !ok || rename(tmp, path) != 0) {
+    unlink(tmp);
+  }
+}
+
+static void http_cache_close(struct transfer *transfer) {
+  if (transfer->cached) {
+    munmap(transfer->cached, transfer->cached_len);
+  }
+
+  curl_slist_free_all(transfer->headers);
+
+  transfer->headers = NULL;
+  transfer->cached = NULL;
+}
+
+/* Picks the validators (and whether we may store the response at all) out of
+ * the response's headers */
+static size_t header_cb(char *data, size_t size, size_t nmemb, void *userp) {
+  struct transfer *transfer = userp;
+  size_t len = size * nmemb;
+
+  /* A new status line means a new response (after a 100 Continue, for
+   * instance), forget about the previous one's headers */
+  if (len >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+    transfer->etag[0] = '\0';
+    transfer->last_modified[0] = '\0';
+    transfer->no_store = false;
+    return len;
+  }
+
+  const char *colon = memchr(data, ':', len);
+
+  if (!colon) {
+    return len;
+  }
+
+  size_t name_len = colon - data;
+  const char *value = colon + 1;
+  size_t value_len = data + len - value;
+
+  while (value_len > 0 && isspace((unsigned char)*value)) {
+    value++;
+    value_len--;
+  }
+
+  while (value_len > 0 && isspace((unsigned char)value[value_len - 1])) {
+    value_len--;
+  }
+
+  char *dst = NULL;
+
+  if (name_len == 4 && strncasecmp(data, "ETag", 4) == 0) {
+    dst = transfer->etag;
+  } else if (name_len == 13 && strncasecmp(data, "Last-Modified", 13) == 0) {
+    dst = transfer->last_modified;
+  } else if (name_len == 13 && strncasecmp(data, "Cache-Control", 13) == 0) {
+    for (size_t i = 0; i + 8 <= value_len; i++) {
+      if (strncasecmp(&value[i], "no-store", 8) == 0) {
+        transfer->no_store = true;
+      }
+    }
+  }
+
+  /* Too long to store, so don't store the response at all */
+  if (dst && value_len >= VALIDATOR_MAX) {
+    transfer->no_store = true;
+  } else if (dst) {
+    memcpy(dst, value, value_len);
+    dst[value_len] = '\0';
+  }
+
+  return len;
+}
+
+/* Serves a 304 from the cache, and stores successful responses that can be
+ * revalidated. Must be called before the response is marked as done, after
+ * which it can be evicted */
+static void http_cache_finish(struct transfer *transfer, const char *dir,
+                              CURLcode result) {
+  long status = 0;
+
+  curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &status);
+
+  if (result != CURLE_OK) {
+    return;
+  }
+
+  if (status == 304 && transfer->cached) {
+    transfer->resp->timing.revalidated = true;
+    write_cb((void *)transfer->cached_body, 1, transfer->cached_body_len,
+             transfer->resp);
+  } else if (status == 200 && !transfer->no_store &&
+             (transfer->etag[0] || transfer->last_modified[0])) {
+    /* Under the URL as it was requested (rather than curl's normalized
+     * CURLINFO_EFFECTIVE_URL), which is what http_cache_open() looks up */
+    http_cache_store(transfer, dir, transfer->resp->url);
+  }
+}
+
+/* Adds a new response to the store and attaches an idle easy handle to the
+ * multi handle to fetch `url` into it */
+static void start_transfer(struct network_worker *worker,
+                           struct transfer *transfer,
+                           const struct request *request) {
+  struct global_state *state = worker->state;
+  CURL *easy = transfer->easy;
+  const char *url = request->url;
+
+  struct curl_response *resp = calloc(1, sizeof(*resp));
+  assert(resp);
+
+  resp->seq = request->seq;
+
+  pthread_mutex_lock(&state->buffer.lock);
+  store_push(&state->buffer, resp);
+  pthread_mutex_unlock(&state->buffer.lock);
+
+  transfer->resp = resp;
+  transfer->queued_at = request->queued_at;
+
+  /* Only read once the response is done */
+  memcpy(resp->url, url, URL_MAX);
+
+  if (trace_local) {
+    transfer->started_at = now_ns();
+
+    /* Ended once the transfer is, with the other spans nested inside */
+    trace_event(TRACE_BEGIN, "request", resp->id, transfer->queued_at, 0, 0);
+    trace_span("queued", resp->id, transfer->queued_at, transfer->started_at);
+  }
+
+  DTRACE_PROBE2(async_tui, transfer__start, resp->id, strlen(url));
+
+  if (state->opts.http_cache_dir) {
+    http_cache_open(transfer, state->opts.http_cache_dir, url);
+  }
+
+  curl_easy_setopt(easy, CURLOPT_URL, url);
+  /* Rather than opening another connection to a host that we're still
+   * connecting to, wait to find out if we can multiplex over that one. Only
+   * over TLS, where HTTP/2 is negotiated during the handshake. Cleartext
+   * connections are HTTP/1, but curl only learns that from the first
+   * response, so waiting on them would serialize requests to the host */
+  curl_easy_setopt(easy, CURLOPT_PIPEWAIT,
+                   (long)(strncasecmp(url, "https://", 8) == 0));
+  curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+  transfer->resolve = disk_cache_resolve(&state->cache, easy);
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, resp);
+  curl_multi_add_handle(worker->multi, easy);
+}
+
+/* A request taken off the queue that's waiting for a free handle, linked into
+ * it's host's list */
+struct pending_request {
+  struct request request;
+  int next;
+};
+
+/* FIFO of the pending requests to a host, as indices into `requests` */
+struct host_queue {
+  uint64_t hash;
+  int head;
+  int tail;
+};
+
+/* Decides which pending request gets the next free handle, going round-robin
+ * across hosts so that a burst of requests to one host can't starve the
+ * others. Requests are only moved here from the worker's queue while there's
+ * room, which bounds how far ahead of the transfers we look (the rest wait in
+ * the queue, and then the main thread's backlog). Hosts are told apart by
+ * `host_hash()`, a collision merely making two hosts share a turn */
+struct host_scheduler {
+  struct pending_request *requests;
+  int n_requests;
+  /* Stack of unused entries in `requests`, linked through `next` */
+  int free;
+  int n_pending;
+  /* Only hosts with pending requests, so at most `n_requests` of them */
+  struct host_queue *hosts;
+  int n_hosts;
+  /* Host whose turn it is */
+  int turn;
+};
+
+/* Pool of easy handles, one per concurrent transfer. `idle` is a stack of
+ * the handles that aren't currently attached to the multi handle */
+struct transfer_pool {
+  struct transfer *handles;
+  struct transfer **idle;
+  int n_handles;
+  int n_idle;
+  struct host_scheduler scheduler;
+  /* When the main thread was last notified of partially received data */
+  uint64_t last_progress;
+};
+
+static void scheduler_init(struct host_scheduler *scheduler, int n_requests) {
+  *scheduler = (struct host_scheduler){.n_requests = n_requests};
+
+  scheduler->requests = calloc(n_requests, sizeof(*scheduler->requests));
+  scheduler->hosts = calloc(n_requests, sizeof(*scheduler->hosts));
+  assert(scheduler->requests && scheduler->hosts);
+
+  for (int i = 0; i < n_requests; i++) {
+    scheduler->requests[i].next = i + 1 < n_requests ? i + 1 : -1;
+  }
+}
+
+static void scheduler_cleanup(struct host_scheduler *scheduler) {
+  free(scheduler->requests);
+  free(scheduler->hosts);
+}
+
+/* There must be room for another request */
+static void scheduler_push(struct host_scheduler *scheduler,
+                           const struct request *request) {
+  int idx = scheduler->free;
+  assert(idx != -1);
+
+  struct pending_request *pending = &scheduler->requests[idx];
+
+  scheduler->free = pending->next;
+  scheduler->n_pending++;
+
+  pending->request = *request;
+  pending->next = -1;
+
+  uint64_t hash = host_hash(request->url);
+
+  for (int i = 0; i < scheduler->n_hosts; i++) {
+    struct host_queue *host = &scheduler->hosts[i];
+
+    if (host->hash == hash) {
+      scheduler->requests[host->tail].next = idx;
+      host->tail = idx;
+      return;
+    }
+  }
+
+  scheduler->hosts[scheduler->n_hosts++] =
+      (struct host_queue){.hash = hash, .head = idx, .tail = idx};
+}
+
+/* Copies out the next request of the host whose turn it is, there must be at
+ * least one pending */
+static void scheduler_pop(struct host_scheduler *scheduler,
+                          struct request *dst) {
+  assert(scheduler->n_pending > 0);
+
+  if (scheduler->turn >= scheduler->n_hosts) {
+    scheduler->turn = 0;
+  }
+
+  struct host_queue *host = &scheduler->hosts[scheduler->turn];
+  int idx = host->head;
+  struct pending_request *pending = &scheduler->requests[idx];
+
+  *dst = pending->request;
+  host->head = pending->next;
+
+  pending->next = scheduler->free;
+  scheduler->free = idx;
+  scheduler->n_pending--;
+
+  /* A host without anything left is replaced by the last one, which gets the
+   * next turn instead */
+  if (host->head == -1) {
+    *host = scheduler->hosts[--scheduler->n_hosts];
+  } else {
+    scheduler->turn++;
+  }
+}
+
+/* Copies the host part of `url` into `dst`, the same part that host_hash()
+ * looks at */
+static void url_host(const char *url, char *dst, size_t max) {
+  const char *host = strstr(url, "://");
+  host = host ? host + 3 : url;
+
+  size_t len = strcspn(host, "/:?#");
+  len = len < max - 1 ? len : max - 1;
+
+  memcpy(dst, host, len);
+  dst[len] = '\0';
+}
+
+static void stats_add(struct transfer_stats *stats,
+                      struct transfer_timing *timing) {
+  pthread_mutex_lock(&stats->lock);
+
+  stats->recent[stats->n_recent++ % STATS_RECENT] = *timing;
+
+  struct host_stats *host = NULL;
+
+  for (size_t i = 0; i < stats->n_hosts && !host; i++) {
+    if (strcmp(stats->hosts[i].host, timing->host) == 0) {
+      host = &stats->hosts[i];
+    }
+  }
+
+  if (!host && stats->n_hosts < STATS_HOSTS) {
+    host = &stats->hosts[stats->n_hosts++];
+    *host = (struct host_stats){0};
+  } else if (!host) {
+    host = &stats->hosts[0];
+
+    for (size_t i = 1; i < STATS_HOSTS; i++) {
+      if (stats->hosts[i].last_used < host->last_used) {
+        host = &stats->hosts[i];
+      }
+    }
+
+    *host = (struct host_stats){0};
+  }
+
+  strcpy(host->host, timing->host);
+
+  host->totals[host->n_totals++ % STATS_WINDOW] = timing->total;
+  host->last_used = ++stats->clock;
+
+  pthread_mutex_unlock(&stats->lock);
+}
+
+/* Fills in the timing of a finished transfer, before it's marked as done */
+static void record_timing(struct global_state *state,
+                          struct transfer *transfer, CURLcode result) {
+  CURL *easy = transfer->easy;
+  struct curl_response *resp = transfer->resp;
+  struct transfer_timing *timing = &resp->timing;
+
+  char *url = NULL;
+
+  curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &url);
+  curl_easy_getinfo(easy, CURLINFO_NAMELOOKUP_TIME_T, &timing->namelookup);
+  curl_easy_getinfo(easy, CURLINFO_CONNECT_TIME_T, &timing->connect);
+  curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &timing->appconnect);
+  curl_easy_getinfo(easy, CURLINFO_PRETRANSFER_TIME_T, &timing->pretransfer);
+  curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T,
+                    &timing->starttransfer);
+  curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME_T, &timing->total);
+  curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &timing->wire_bytes);
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &timing->status);
+
+  /* Only 200s are ever cached */
+  if (timing->revalidated) {
+    timing->status = 200;
+  }
+
+  /* Only written to by us until the transfer is done */
+  timing->decoded_bytes = resp->size;
+  timing->result = result;
+
+  url_host(url ? url : "", timing->host, sizeof(timing->host));
+
+  state->wire_bytes += timing->wire_bytes;
+  state->decoded_bytes += timing->decoded_bytes;
+
+  stats_add(&state->stats, timing);
+}
+
+/* Reaps finished transfers, starts queued ones and notifies the main thread
+ * of progress. This is the part that's common to both engines, run before
+ * every wait. Returns the timeout (in milliseconds, -1 being infinite) for
+ * the wait, which is at most `max_timeout` */
+static int service_transfers(struct network_worker *worker,
+                             struct transfer_pool *pool, int max_timeout) {
+  struct global_state *state = worker->state;
+
+  /* Transfers completed/failed, return their handles to the pool */
+  CURLMsg *msg;
+
+  while ((msg = curl_multi_info_read(worker->multi, &(int){0}))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    CURL *easy = msg->easy_handle;
+    struct transfer *transfer;
+
+    curl_easy_getinfo(easy, CURLINFO_PRIVATE, &transfer);
+    disk_cache_record(&state->cache, easy, msg->data.result);
+
+    if (state->opts.http_cache_dir) {
+      http_cache_finish(transfer, state->opts.http_cache_dir,
+                        msg->data.result);
+    }
+
+    http_cache_close(transfer);
+    curl_multi_remove_handle(worker->multi, easy);
+
+    /* Applied when the transfer started, so it's not needed anymore */
+    if (transfer->resolve) {
+      curl_easy_setopt(easy, CURLOPT_RESOLVE, NULL);
+      curl_slist_free_all(transfer->resolve);
+      transfer->resolve = NULL;
+    }
+
+    record_timing(state, transfer, msg->data.result);
+
+    struct transfer_timing *timing = &transfer->resp->timing;
+
+    DTRACE_PROBE4(async_tui, transfer__done, transfer->resp->id,
+                  timing->status, timing->decoded_bytes, timing->total);
+
+    if (trace_local) {
+      uint64_t now = now_ns();
+      size_t id = transfer->resp->id;
+
+      trace_span("transfer", id, transfer->started_at, now);
+      trace_event(TRACE_MARK, "completed", id, now, 0, timing->status);
+      trace_event(TRACE_END, "request", id, now, 0, 0);
+    }
+
+    pool->idle[pool->n_idle++] = transfer;
+    worker->load--;
+
+    pthread_mutex_lock(&state->buffer.lock);
+    store_finish(&state->buffer, transfer->resp);
+    pthread_mutex_unlock(&state->buffer.lock);
+
+    notify_main(state);
+  }
+
+  /* Start as many of the pending requests as we have free handles for, the
+   * rest wait until a transfer finishes */
+  struct host_scheduler *scheduler = &pool->scheduler;
+  const struct request *request;
+
+  while (scheduler->n_pending < scheduler->n_requests &&
+         (request = queue_peek(&worker->queue))) {
+    scheduler_push(scheduler, request);
+    queue_pop(&worker->queue);
+  }
+
+  while (pool->n_idle > 0 && scheduler->n_pending > 0) {
+    struct request next;
+
+    scheduler_pop(scheduler, &next);
+    start_transfer(worker, pool->idle[--pool->n_idle], &next);
+  }
+
+  int timeout = max_timeout;
+
+  /* Let the main thread display partially received responses, at most as
+   * often as it draws frames anyway. We mustn't sleep past the point where we
+   * can notify it about pending progress */
+  if (atomic_load_explicit(&state->buffer.progress, memory_order_relaxed)) {
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - pool->last_progress;
+
+    if (elapsed >= state->scheduler.interval) {
+      state->buffer.progress = false;
+      pool->last_progress = now;
+
+      notify_main(state);
+    } else {
+      int until_deadline =
+          (state->scheduler.interval - elapsed + 999999) / 1000000;
+
+      if (timeout == -1 || until_deadline < timeout) {
+        timeout = until_deadline;
+      }
+    }
+  }
+
+  /* Only ask to be woken up for new requests when we have a free handle to
+   * service them with, a finished transfer will wake us up anyway. The queue
+   * must be checked again after setting `parked`, as the producer might
+   * have pushed a URL right before it, without waking us up */
+  bool parked = pool->n_idle > 0;
+
+  worker->queue.parked = parked;
+
+  if (parked && queue_peek(&worker->queue)) {
+    timeout = 0;
+  }
+
+  return timeout;
+}
+
+static void drain_wake_fd(struct network_worker *worker) {
+  uint64_t count;
+  read(worker->wake_fd, &count, sizeof(count));
+}
+
+/* The default engine, curl_multi_perform() looks at every transfer after each
+ * wake up. Simple, and perfectly fine for a handful of transfers */
+static void run_poll_engine(struct network_worker *worker,
+                            struct transfer_pool *pool) {
+  while (!worker->state->done) {
+    int running_handles;
+
+    CURLMcode code = curl_multi_perform(worker->multi, &running_handles);
+
+    if (code != CURLM_OK) {
+      break;
+    }
+
+    int timeout = service_transfers(worker, pool, 10000);
+
+    /* We prefer the curl_multi_poll API as that allows us to nearly instantly
+     * interrupt the transfers and cleanup on Ctrl + C, the wake fd being
+     * written to by the main thread */
+    struct curl_waitfd waker = {.fd = worker->wake_fd,
+                                .events = CURL_WAIT_POLLIN};
+
+    int ret = curl_multi_poll(worker->multi, &waker, 1, timeout, &(int){0});
+
+    worker->queue.parked = false;
+
+    if (ret != CURLM_OK) {
+      break;
+    }
+
+    if (waker.revents & CURL_WAIT_POLLIN) {
+      drain_wake_fd(worker);
+    }
+  }
+}
+
+struct epoll_engine {
+  int epoll_fd;
+  /* Armed with the timeout requested by curl */
+  int timer_fd;
+};
+
+/* curl tells us which sockets to wait on for what */
+static int socket_cb(CURL *easy, curl_socket_t fd, int what, void *userp,
+                     void *socketp) {
+  struct epoll_engine *engine = userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+  }
+
+  struct epoll_event ev = {
+      .events = (what & CURL_POLL_IN ? EPOLLIN : 0) |
+                (what & CURL_POLL_OUT ? EPOLLOUT : 0),
+      .data.fd = fd,
+  };
+
+  if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+      errno == ENOENT) {
+    epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  return 0;
+}
+
+static int timer_cb(CURLM *multi, long timeout_ms, void *userp) {
+  struct epoll_engine *engine = userp;
+
+  /* -1 disarms the timer, 0 means "as soon as possible", for which we still
+   * need a non-zero value as that'd disarm the timer too */
+  struct itimerspec its = {0};
+
+  if (timeout_ms == 0) {
+    its.it_value.tv_nsec = 1;
+  } else if (timeout_ms > 0) {
+    its.it_value.tv_sec = timeout_ms / 1000;
+    its.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  }
+
+  timerfd_settime(engine->timer_fd, 0, &its, NULL);
+
+  return 0;
+}
+
+/* Alternative engine for a large number of concurrent transfers, curl only
+ * gets to look at the sockets that are actually ready (and the timeout) via
+ * curl_multi_socket_action(), so the cost of each wake up is independent of
+ * the number of transfers */
+static void run_epoll_engine(struct network_worker *worker,
+                             struct transfer_pool *pool) {
+  struct epoll_engine engine = {
+      .epoll_fd = epoll_create1(EPOLL_CLOEXEC),
+      .timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC),
+  };
+  assert(engine.epoll_fd != -1 && engine.timer_fd != -1);
+
+  /* The timer and wake fds can't clash with curl's sockets */
+  int fds[] = {engine.timer_fd, worker->wake_fd};
+
+  for (size_t i = 0; i < sizeof(fds) / sizeof(*fds); i++) {
+    epoll_ctl(engine.epoll_fd, EPOLL_CTL_ADD, fds[i],
+              &(struct epoll_event){.events = EPOLLIN, .data.fd = fds[i]});
+  }
+
+  curl_multi_setopt(worker->multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+  curl_multi_setopt(worker->multi, CURLMOPT_SOCKETDATA, &engine);
+  curl_multi_setopt(worker->multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+  curl_multi_setopt(worker->multi, CURLMOPT_TIMERDATA, &engine);
+
+  while (!worker->state->done) {
+    int timeout = service_transfers(worker, pool, -1);
+
+    struct epoll_event events[64];
+
+    int n = epoll_wait(engine.epoll_fd, events, 64, timeout);
+
+    worker->queue.parked = false;
+
+    if (n == -1 && errno != EINTR) {
+      break;
+    }
+
+    int running_handles;
+    CURLMcode code = CURLM_OK;
+
+    for (int i = 0; i < n && code == CURLM_OK; i++) {
+      int fd = events[i].data.fd;
+
+      if (fd == engine.timer_fd) {
+        uint64_t expirations;
+        read(engine.timer_fd, &expirations, sizeof(expirations));
+
+        code = curl_multi_socket_action(worker->multi, CURL_SOCKET_TIMEOUT, 0,
+                                        &running_handles);
+      } else if (fd == worker->wake_fd) {
+        drain_wake_fd(worker);
+      } else {
+        int flags = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0) |
+                    (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0) |
+                    (events[i].events & (EPOLLERR | EPOLLHUP) ? CURL_CSELECT_ERR
+                                                                : 0);
+
+        code = curl_multi_socket_action(worker->multi, fd, flags,
+                                        &running_handles);
+      }
+    }
+
+    if (code != CURLM_OK) {
+      break;
+    }
+  }
+
+  close(engine.timer_fd);
+  close(engine.epoll_fd);
+}
+
+void *network_thread(void *arg) {
+  struct network_worker *worker = arg;
+  struct global_state *state = worker->state;
+
+  if (state->opts.trace_path) {
+    trace_local = &worker->trace;
+  }
+
+  struct transfer_pool pool = {
+      .n_handles = state->opts.max_in_flight,
+  };
+
+  pool.handles = calloc(pool.n_handles, sizeof(*pool.handles));
+  pool.idle = calloc(pool.n_handles, sizeof(*pool.idle));
+  assert(pool.handles && pool.idle);
+
+  /* As much as the queue holds, so that a request to another host can't be
+   * stuck behind a whole queue's worth of requests to a busy one */
+  scheduler_init(&pool.scheduler, QUEUE_SIZE);
+
+  for (int i = 0; i < pool.n_handles; i++) {
+    struct transfer *transfer = &pool.handles[i];
+    CURL *easy = curl_easy_init();
+    assert(easy);
+
+    transfer->easy = easy;
+
+    curl_easy_setopt(easy, CURLOPT_SHARE, state->share.handle);
+    curl_easy_setopt(easy, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    /* Offer every encoding curl can decode (gzip, brotli, zstd, depending on
+     * how it was built). It decodes as the data arrives, so write_cb (and
+     * thus the UI) only ever sees the decoded body */
+    curl_easy_setopt(easy, CURLOPT_ACCEPT_ENCODING, "");
+    /* Lets us map the handle back to it's transfer once it's done */
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, transfer);
+
+    pool.idle[pool.n_idle++] = transfer;
+  }
+
+  switch (state->opts.engine) {
+  case ENGINE_POLL:
+    run_poll_engine(worker, &pool);
+    break;
+  case ENGINE_EPOLL:
+    run_epoll_engine(worker, &pool);
+    break;
+  }
+
+  if (!state->done) {
+    assert(!"CURL returned failure without being interrupted!");
+  }
+
+  /* Removing a handle that isn't attached to the multi handle is a no-op */
+  for (int i = 0; i < pool.n_handles; i++) {
+    curl_multi_remove_handle(worker->multi, pool.handles[i].easy);
+    curl_easy_cleanup(pool.handles[i].easy);
+    curl_slist_free_all(pool.handles[i].resolve);
+    http_cache_close(&pool.handles[i]);
+  }
+
+  free(pool.handles);
+  free(pool.idle);
+  scheduler_cleanup(&pool.scheduler);
+
+  pthread_exit(NULL);
+}
+
+/* Picks the network thread that should perform the transfer for `url` */
+static struct network_worker *pick_worker(struct global_state *state,
+                                          const char *url) {
+  int n_workers = state->opts.n_workers;
+
+  switch (state->opts.distribution) {
+  case DISTRIBUTE_HOST:
+    /* Keeps all transfers to a host on one thread, and thus on it's
+     * connections */
+    return &state->workers[host_hash(url) % n_workers];
+  case DISTRIBUTE_LEAST_LOADED:
+    break;
+  }
+
+  struct network_worker *best = &state->workers[0];
+
+  for (int i = 1; i < n_workers; i++) {
+    if (state->workers[i].load < best->load) {
+      best = &state->workers[i];
+    }
+  }
+
+  return best;
+}
+
+/* Moves as many requests as fit from the backlog into the queues, in order */
+static void flush_backlog(struct global_state *state) {
+  struct request_backlog *backlog = &state->backlog;
+
+  for (; backlog->len > 0; backlog->len--) {
+    const struct request *request = &backlog->requests[backlog->head];
+    struct network_worker *worker = pick_worker(state, request->url);
+
+    if (!queue_push(&worker->queue, request)) {
+      break;
+    }
+
+    worker->load++;
+
+    /* Wake up the reader, only if it's actually waiting on us */
+    if (worker->queue.parked) {
+      wake_network(worker);
+    }
+
+    backlog->head = (backlog->head + 1) % backlog->capacity;
+  }
+}
+
+void send_request(struct global_state *state, char *buf) {
+  struct request_backlog *backlog = &state->backlog;
+
+  if (backlog->len == backlog->capacity) {
+    size_t capacity = backlog->capacity ? 2 * backlog->capacity : 16;
+    struct request *requests = malloc(capacity * sizeof(*requests));
+    assert(requests);
+
+    /* Unwrap the ring while copying it over */
+    for (size_t i = 0; i < backlog->len; i++) {
+      requests[i] =
+          backlog->requests[(backlog->head + i) % backlog->capacity];
+    }
+
+    free(backlog->requests);
+
+    backlog->requests = requests;
+    backlog->head = 0;
+    backlog->capacity = capacity;
+  }
+
+  struct request *request =
+      &backlog->requests[(backlog->head + backlog->len) % backlog->capacity];
+
+  snprintf(request->url, URL_MAX, "%s", buf);
+  request->queued_at = now_ns();
+  request->seq = backlog->n_sent++;
+  backlog->len++;
+
+  DTRACE_PROBE1(async_tui, request, strlen(buf));
+
+  flush_backlog(state);
+}
+
+static void read_char(struct global_state *state, char buf[URL_MAX], char c) {
+  size_t len = strlen(buf);
+
+  switch (c) {
+  /* Newline */
+  case '\r':
+    send_request(state, buf);
+    memset(buf, 0, URL_MAX);
+    break;
+  /* Backspace */
+  case 127:
+  case '\b':
+    if (len > 0) {
+      buf[len - 1] = '\0';
+    }
+    break;
+  /* Double quote scrolls down */
+  case '"':
+    state->scroll--;
+    break;
+  /* Single quote scrolls down */
+  case '\'':
+    state->scroll++;
+    break;
+  /* Ctrl + T */
+  case 20:
+    state->show_stats = !state->show_stats;
+    break;
+  default:
+    if ((len + 1) < URL_MAX && isprint(c)) {
+      buf[len] = c;
+    }
+  }
+}
+
+/* Replaces row `y` of the screen with the formatted text */
+__attribute__((format(printf, 3, 4))) static void
+overlay_put(struct screen *screen, int y, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+
+  int len = vsnprintf(screen->line, 4 * screen->cols, fmt, args);
+
+  va_end(args);
+
+  for (int x = 0; x < screen->cols; x++) {
+    screen->cells[y * screen->cols + x] = ' ';
+  }
+
+  if (len > 0) {
+    screen_put(screen, y, screen->line,
+               len < 4 * screen->cols ? len : 4 * screen->cols - 1);
+  }
+}
+
+/* Difference between two of the cumulative times in milliseconds, phases
+ * that didn't happen (a reused connection, no TLS) have no time */
+static double phase_ms(curl_off_t end, curl_off_t start) {
+  return end > start ? (end - start) / 1000.0 : 0;
+}
+
+static int compare_off(const void *a, const void *b) {
+  curl_off_t x = *(const curl_off_t *)a;
+  curl_off_t y = *(const curl_off_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Draws the latest transfers, and the percentiles of the total time of the
+ * recent ones per host, over the top of the screen (leaving the prompt) */
+static void draw_stats(struct global_state *state) {
+  struct screen *screen = &state->screen;
+  struct transfer_stats *stats = &state->stats;
+
+  int y = 0;
+  int max_y = screen->rows - 1;
+
+  pthread_mutex_lock(&stats->lock);
+
+  /* Sized to fit in 80 columns */
+  if (y < max_y) {
+    overlay_put(screen, y++, "%-18s %6s %6s %6s %6s %6s %6s %7s %8s",
+                "latest transfers", "status", "dns", "tcp", "tls", "wait",
+                "recv", "total", "KiB");
+  }
+
+  size_t n_recent =
+      stats->n_recent < STATS_RECENT ? stats->n_recent : STATS_RECENT;
+
+  for (size_t i = 0; i < n_recent && y < max_y; i++) {
+    struct transfer_timing *t =
+        &stats->recent[(stats->n_recent - 1 - i) % STATS_RECENT];
+
+    char status[8];
+    snprintf(status, sizeof(status), "%ld", t->status);
+
+    overlay_put(screen, y++,
+                "%-18.18s %6s %6.1f %6.1f %6.1f %6.1f %6.1f %7.1f %8.1f",
+                t->host,
+                t->result != CURLE_OK ? "error"
+                : t->revalidated      ? "cached"
+                                      : status,
+                phase_ms(t->namelookup, 0),
+                phase_ms(t->connect, t->namelookup),
+                phase_ms(t->appconnect, t->connect),
+                phase_ms(t->starttransfer, t->pretransfer),
+                phase_ms(t->total, t->starttransfer), phase_ms(t->total, 0),
+                t->wire_bytes / 1024.0);
+  }
+
+  if (y < max_y) {
+    overlay_put(screen, y++, "%-24s %6s %8s %8s %8s", "per host (ms)", "n",
+                "p50", "p95", "p99");
+  }
+
+  for (size_t i = 0; i < stats->n_hosts && y < max_y; i++) {
+    struct host_stats *host = &stats->hosts[i];
+    curl_off_t sorted[STATS_WINDOW];
+
+    size_t n = host->n_totals < STATS_WINDOW ? host->n_totals : STATS_WINDOW;
+
+    memcpy(sorted, host->totals, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_off);
+
+    /* Nearest rank */
+    int percentiles[] = {50, 95, 99};
+    double p[3];
+
+    for (int j = 0; j < 3; j++) {
+      size_t rank = (percentiles[j] * n + 99) / 100;
+      p[j] = sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+    }
+
+    overlay_put(screen, y++, "%-24.24s %6zu %8.1f %8.1f %8.1f", host->host,
+                host->n_totals, p[0], p[1], p[2]);
+  }
+
+  pthread_mutex_unlock(&stats->lock);
+
+  struct latency_histogram *latency = &state->latency;
+
+  if (y < max_y && latency->n > 0) {
+    overlay_put(screen, y++, "%-24s %6s %8s %8s %8s %8s %8s",
+                "input latency (ms)", "n", "p50", "p90", "p99", "p99.9",
+                "max");
+  }
+
+  if (y < max_y && latency->n > 0) {
+    overlay_put(screen, y++, "%-24s %6llu %8.2f %8.2f %8.2f %8.2f %8.2f",
+                "keypress to frame", (unsigned long long)latency->n,
+                latency_percentile(latency, 50) / 1000.0,
+                latency_percentile(latency, 90) / 1000.0,
+                latency_percentile(latency, 99) / 1000.0,
+                latency_percentile(latency, 99.9) / 1000.0,
+                latency->max / 1000.0);
+  }
+
+  /* Separates the overlay from the responses below it */
+  if (y < max_y) {
+    for (int x = 0; x < screen->cols; x++) {
+      screen->cells[y * screen->cols + x] = '-';
+    }
+  }
+}
+
+static void redraw(struct global_state *state, char *buf) {
+  DTRACE_PROBE(async_tui, redraw__start);
+
+  uint64_t start = trace_local ? now_ns() : 0;
+
+  struct wsize size = get_win_size();
+
+  screen_begin(&state->screen, size);
+
+  int y = size.rows - 1;
+
+  /* Skip N lines from the bottom to provide a scrolling effect, scrolling
+   * below the bottom is the same as not scrolling at all */
+  int n_skip = state->scroll > 0 ? state->scroll : 0;
+
+  struct response_store *store = &state->buffer;
+
+  pthread_mutex_lock(&store->lock);
+
+  /* Pick up whatever arrived for the transfers still in progress */
+  for (size_t i = 0; i < store->n_active; i++) {
+    store_sync(store, store->active[i]);
+  }
+
+  if ((size_t)n_skip < store->n_lines) {
+    /* The bottommost line on screen, counting from the oldest line */
+    size_t line = store->n_lines - 1 - n_skip;
+    size_t bottom = store->base + tree_find(store, &line);
+
+    for (size_t i = bottom + 1; i > store->first && y > 0; i--) {
+      struct curl_response *resp = store_get(store, i - 1);
+
+      /* Evicted */
+      if (!resp) {
+        continue;
+      }
+
+      /* Only the lines that actually end up on screen are looked at */
+      size_t from = (i - 1) == bottom ? line + 1 : resp_line_count(resp);
+
+      for (; from > 0 && y > 0; from--) {
+        size_t len = resp_line(resp, from - 1, state->screen.line,
+                               4 * state->screen.cols);
+
+        screen_put(&state->screen, --y, state->screen.line, len);
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&store->lock);
+
+  if (state->show_stats) {
+    draw_stats(state);
+  }
+
+  size_t len = strlen(buf);
+
+  screen_put(&state->screen, size.rows - 1, buf, len);
+  screen_flush(&state->screen, &state->frame, size.rows,
+               len < size.cols ? len + 1 : size.cols);
+
+  size_t frame_bytes = state->frame.len;
+  uint64_t flush_start = trace_local ? now_ns() : 0;
+
+  frame_flush(&state->frame);
+
+  /* Everything typed before this frame was drawn is now visible */
+  if (state->input_at) {
+    latency_record(&state->latency, (now_ns() - state->input_at) / 1000);
+    state->input_at = 0;
+  }
+
+  trace_complete("frame flush", flush_start, frame_bytes);
+  trace_complete("redraw", start, 0);
+
+  DTRACE_PROBE1(async_tui, redraw__end, frame_bytes);
+}
+
+/* Number of lines of `resp` that start before `offset` */
+static size_t lines_before(struct curl_response *resp, size_t offset) {
+  size_t lo = 0;
+  size_t hi = resp->view_newlines;
+
+  /* Lines start right after a newline, so count the newlines before
+   * `offset - 1` */
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (resp->newlines[mid] + 1 < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return offset > 0 ? lo + 1 : 0;
+}
+
+/* Compresses up to COMPACT_BATCH chunks of finished, in-memory responses that
+ * are at least COMPACT_DISTANCE lines away from the viewport. Each response's
+ * chunks are compressed in order, stopping at the first one that's too close
+ * (until the viewport moves away). Returns whether there might be more to
+ * compact */
+static bool compact_step(struct global_state *state) {
+  struct response_store *store = &state->buffer;
+  int budget = COMPACT_BATCH;
+
+  pthread_mutex_lock(&store->lock);
+
+  /* Lines that are on screen, counting from the oldest line */
+  size_t n_skip = state->scroll > 0 ? state->scroll : 0;
+  size_t bottom = store->n_lines > n_skip ? store->n_lines - n_skip : 0;
+  size_t top = bottom > state->screen.rows ? bottom - state->screen.rows : 0;
+
+  size_t start = 0;
+
+  for (size_t id = store->first; id < store->latest_response && budget > 0;
+       id++) {
+    struct curl_response *resp = store_get(store, id);
+
+    if (!resp) {
+      continue;
+    }
+
+    size_t first_line = start;
+    start += resp->tree_lines;
+
+    if (!resp->done || resp->spilled) {
+      continue;
+    }
+
+    for (; budget > 0 && resp->n_packed < resp->n_chunks; budget--) {
+      size_t offset = resp->n_packed * CHUNK_SIZE;
+      size_t end = offset + chunk_len(resp, resp->n_packed);
+      size_t from = first_line + lines_before(resp, offset);
+      size_t to = first_line + lines_before(resp, end);
+
+      if (to + COMPACT_DISTANCE <= top || from >= bottom + COMPACT_DISTANCE) {
+        pack_chunk(store, resp, resp->n_packed++);
+      } else {
+        break;
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&store->lock);
+
+  /* Having used up the whole batch, there might be more */
+  return budget == 0;
+}
+
+/* State of batch mode, only touched by the main thread */
+struct batch {
+  int fd;
+  bool eof;
+  /* The line being read, and whether it's already too long to be a URL */
+  char line[URL_MAX];
+  size_t line_len;
+  bool overlong;
+  /* Sequence number of the next request to write out, we're done once
+   * every request has been after the end of the input */
+  size_t next;
+  /* Ring mapping the sequence numbers of the requests not written out yet
+   * to the ids of their responses, plus one (0 if the transfer hasn't
+   * started yet). Transfers start (and finish) out of order, so the ones
+   * that finish early wait in the store for their turn */
+  size_t *ids;
+  size_t ids_capacity;
+  /* The responses up to this id have been entered into `ids` */
+  size_t scanned;
+  size_t n_failed;
+};
+
+/* Makes room in `ids` for the request about to be sent */
+static void batch_reserve(struct global_state *state, struct batch *batch) {
+  size_t seq = state->backlog.n_sent;
+
+  if (seq - batch->next == batch->ids_capacity) {
+    size_t capacity = batch->ids_capacity ? 2 * batch->ids_capacity : 64;
+    size_t *ids = malloc(capacity * sizeof(*ids));
+    assert(ids);
+
+    /* `capacity` is always a power of two */
+    for (size_t i = batch->next; i < seq; i++) {
+      ids[i & (capacity - 1)] = batch->ids[i & (batch->ids_capacity - 1)];
+    }
+
+    free(batch->ids);
+
+    batch->ids = ids;
+    batch->ids_capacity = capacity;
+  }
+
+  batch->ids[seq & (batch->ids_capacity - 1)] = 0;
+}
+
+/* Reads what's available of the input, sending a request per line */
+static void batch_read(struct global_state *state, struct batch *batch) {
+  char input[4096];
+
+  ssize_t ret = read(batch->fd, input, sizeof(input));
+
+  if (ret == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+
+  if (ret <= 0) {
+    if (ret == -1) {
+      fprintf(stderr, "failed to read input: %s\n", strerror(errno));
+    }
+
+    /* A last line without a newline still counts */
+    batch->eof = true;
+    ret = 0;
+    input[ret++] = '\n';
+  }
+
+  for (ssize_t i = 0; i < ret; i++) {
+    char c = input[i];
+
+    if (c != '\n') {
+      /* Same as the prompt, which also drops a '\r' from CRLF line endings */
+      if (!isprint(c)) {
+        continue;
+      }
+
+      if (batch->line_len + 1 < URL_MAX) {
+        batch->line[batch->line_len++] = c;
+      } else {
+        batch->overlong = true;
+      }
+
+      continue;
+    }
+
+    batch->line[batch->line_len] = '\0';
+
+    if (batch->overlong) {
+      fprintf(stderr, "skipping URL longer than %d bytes: %s...\n",
+              URL_MAX - 1, batch->line);
+    } else if (batch->line_len > 0) {
+      batch_reserve(state, batch);
+      send_request(state, batch->line);
+    }
+
+    batch->line_len = 0;
+    batch->overlong = false;
+  }
+}
+
+/* Writes out the body of a finished response, preceded by a
+ * "<status> <length> <url>" line if records are framed. The status is 0 if
+ * the transfer failed. Returns false if stdout is gone */
+static bool batch_write(struct global_state *state,
+                        struct curl_response *resp) {
+  struct transfer_timing *timing = &resp->timing;
+
+  if (timing->result != CURLE_OK) {
+    fprintf(stderr, "%s: %s\n", resp->url,
+            curl_easy_strerror(timing->result));
+  }
+
+  if (state->opts.framed) {
+    char header[URL_MAX + 64];
+    int len = snprintf(header, sizeof(header), "%ld %zu %s\n",
+                       timing->result == CURLE_OK ? timing->status : 0,
+                       resp->size, resp->url);
+
+    if (!write_all(STDOUT_FILENO, header, len)) {
+      return false;
+    }
+  }
+
+  if (resp->map) {
+    return write_all(STDOUT_FILENO, resp->map, resp->size);
+  }
+
+  char buf[CHUNK_SIZE];
+
+  for (size_t offset = 0; offset < resp->size; offset += CHUNK_SIZE) {
+    size_t len = resp->size - offset;
+    len = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+
+    resp_read(resp, offset, buf, len);
+
+    if (!write_all(STDOUT_FILENO, buf, len)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Writes out the finished responses in the order of the input, freeing each
+ * one right after. Stops at the first one that's still in progress. Returns
+ * false if stdout is gone */
+static bool batch_flush(struct global_state *state, struct batch *batch) {
+  struct response_store *store = &state->buffer;
+
+  pthread_mutex_lock(&store->lock);
+
+  /* Every id is looked at once, none of them can have been freed yet */
+  for (; batch->scanned < store->latest_response; batch->scanned++) {
+    struct curl_response *resp = store_get(store, batch->scanned);
+
+    batch->ids[resp->seq & (batch->ids_capacity - 1)] = batch->scanned + 1;
+  }
+
+  pthread_mutex_unlock(&store->lock);
+
+  while (batch->next < state->backlog.n_sent) {
+    size_t id = batch->ids[batch->next & (batch->ids_capacity - 1)];
+
+    if (id == 0) {
+      return true;
+    }
+
+    pthread_mutex_lock(&store->lock);
+
+    struct curl_response *resp = store_get(store, id - 1);
+    bool done = resp->done;
+
+    pthread_mutex_unlock(&store->lock);
+
+    if (!done) {
+      return true;
+    }
+
+    /* Nothing touches a finished response but us (there's no compaction in
+     * batch mode, and it can't be evicted), so it's read without the lock
+     * to not hold up the network threads on a slow reader */
+    bool ok = batch_write(state, resp);
+    /* For the caller's error message, freeing the response might clobber
+     * it */
+    int write_errno = errno;
+
+    if (resp->timing.result != CURLE_OK) {
+      batch->n_failed++;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    store_evict(store, id - 1);
+    pthread_mutex_unlock(&store->lock);
+
+    batch->next++;
+
+    if (!ok) {
+      errno = write_errno;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Fetches the URLs listed in `opts.batch_path` (one per line, "-" for
+ * stdin), writing the bodies to stdout in the same order. Runs until
+ * everything's been written out, returning the exit status */
+static int run_batch(struct global_state *state) {
+  struct batch batch = {.fd = STDIN_FILENO};
+
+  if (strcmp(state->opts.batch_path, "-") != 0) {
+    batch.fd = open(state->opts.batch_path, O_RDONLY | O_CLOEXEC);
+
+    if (batch.fd == -1) {
+      fprintf(stderr, "failed to open %s: %s\n", state->opts.batch_path,
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  struct response_store *store = &state->buffer;
+
+  /* Nothing is evicted before it's written out */
+  pthread_mutex_lock(&store->lock);
+  store->pinned = true;
+  pthread_mutex_unlock(&store->lock);
+
+  bool ok = true;
+
+  while (ok && !(batch.eof && batch.next == state->backlog.n_sent)) {
+    /* Stop reading while the network threads have enough to do, or the
+     * responses waiting to be written out (behind a slow one) fill up the
+     * budget. Otherwise a long input would all end up in memory */
+    pthread_mutex_lock(&store->lock);
+    bool full = store_over_budget(store);
+    pthread_mutex_unlock(&store->lock);
+
+    bool want_input =
+        !batch.eof && !full && state->backlog.len < QUEUE_SIZE;
+
+    struct pollfd fds[] = {
+        {.fd = state->notify_fd, .events = POLL_IN},
+        {.fd = want_input ? batch.fd : -1, .events = POLL_IN}};
+
+    int ret = poll(fds, 2, -1);
+    assert(ret > 0 || errno == EINTR);
+
+    if (fds[1].revents & (POLL_IN | POLLHUP)) {
+      batch_read(state, &batch);
+    }
+
+    if (fds[0].revents & POLL_IN) {
+      consume_notify(state);
+
+      /* Finished transfers make room in the queue */
+      flush_backlog(state);
+    }
+
+    ok = batch_flush(state, &batch);
+  }
+
+  if (batch.fd != STDIN_FILENO) {
+    close(batch.fd);
+  }
+
+  free(batch.ids);
+
+  if (!ok) {
+    fprintf(stderr, "failed to write output: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (batch.n_failed > 0) {
+    fprintf(stderr, "%zu of %zu transfers failed\n", batch.n_failed,
+            state->backlog.n_sent);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/* Runs the TUI until Ctrl + C is pressed */
+static void run_ui(struct global_state *state) {
+  struct termios original_tios;
+  make_term_raw(&original_tios);
+
+  char buf[URL_MAX] = {0};
+
+  struct redraw_scheduler *scheduler = &state->scheduler;
+
+  for (;;) {
+    /* Block indefinitely if there's nothing to draw, otherwise draw right away
+     * if the next frame is due, or wait until it is */
+    int timeout = -1;
+
+    if (scheduler->dirty) {
+      uint64_t now = now_ns();
+
+      if (now - scheduler->last_frame >= scheduler->interval) {
+        redraw(state, buf);
+
+        scheduler->dirty = false;
+        scheduler->last_frame = now;
+      } else {
+        uint64_t remaining =
+            scheduler->interval - (now - scheduler->last_frame);
+
+        /* Round up, so that we don't wake up just before the deadline */
+        timeout = (remaining + 999999) / 1000000;
+      }
+    }
+
+    /* Otherwise, use the time to compact cold responses, once it's been idle
+     * for a while */
+    struct compactor *compactor = &state->compactor;
+
+    if (timeout == -1 && compactor->pending) {
+      uint64_t idle = now_ns() - compactor->last_activity;
+
+      timeout =
+          idle >= COMPACT_IDLE ? 0 : (COMPACT_IDLE - idle + 999999) / 1000000;
+    }
+
+    struct pollfd fds[] = {
+        {.fd = STDIN_FILENO, .events = POLL_IN},
+        {.fd = state->notify_fd, .events = POLL_IN},
+        {.fd = state->signal_fd, .events = POLL_IN}};
+
+    int ready = poll(fds, 3, timeout);
+
+    if (ready > 0) {
+      compactor->pending = true;
+      compactor->last_activity = now_ns();
+    } else if (ready == 0 && !scheduler->dirty && compactor->pending &&
+               now_ns() - compactor->last_activity >= COMPACT_IDLE) {
+      compactor->pending = compact_step(state);
+    }
+
+    if (fds[0].revents & POLL_IN) {
+      /* Handle everything that was typed (or pasted) since the last wake up
+       * in one go, rather than drawing a frame per character */
+      char input[256];
+
+      int ret = read(STDIN_FILENO, input, sizeof(input));
+      assert(ret > 0);
+
+      if (!state->input_at) {
+        state->input_at = now_ns();
+      }
+
+      /* Ctrl + C */
+      if (memchr(input, 3, ret)) {
+        break;
+      }
+
+      for (int i = 0; i < ret; i++) {
+        read_char(state, buf, input[i]);
+      }
+
+      scheduler->dirty = true;
+    }
+
+    /* New data recevied, however many notifications were sent since */
+    if (fds[1].revents & POLL_IN) {
+      /* Nothing to do -- just redraw
+       * We read() the eventfd here to reset it to prevent poll() from
+       * returning instantly, causing an expensive infinite loop */
+      if (consume_notify(state)) {
+        scheduler->dirty = true;
+      }
+
+      /* Finished transfers make room in the queue */
+      flush_backlog(state);
+    }
+
+    /* SIGWINCH received, same as above. Multiple pending signals are merged
+     * into one by the kernel */
+    if (fds[2].revents & POLL_IN) {
+      struct signalfd_siginfo info;
+
+      int ret = read(state->signal_fd, &info, sizeof(info));
+      assert(ret == sizeof(info));
+
+      scheduler->dirty = true;
+    }
+  }
+
+  restore_term(&original_tios);
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+          "usage: %s [-j max_in_flight] [-m budget_mib] [-f max_fps] "
+          "[-e poll|epoll] [-w workers] [-d host|least] [-c cache_file] "
+          "[-p max_host_connections] [-t max_connections] "
+          "[-C http_cache_dir] [-s spill_mib] [-D disk_budget_mib] "
+          "[-T trace_file] [-b url_file [-r]]\n",
+          argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  struct options opts = {
+      .max_in_flight = 8,
+      .budget = 256 << 20,
+      .spill_threshold = 32 << 20,
+      .disk_budget = (size_t)1024 << 20,
+      .max_fps = 60,
+      .n_workers = 1,
+  };
+
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:m:f:e:w:d:c:p:t:C:s:D:T:b:r")) != -1) {
+    switch (opt) {
+    case 'j':
+      opts.max_in_flight = atoi(optarg);
+      break;
+    case 'm':
+      opts.budget = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'f':
+      opts.max_fps = atoi(optarg);
+      break;
+    case 'e':
+      if (strcmp(optarg, "poll") == 0) {
+        opts.engine = ENGINE_POLL;
+      } else if (strcmp(optarg, "epoll") == 0) {
+        opts.engine = ENGINE_EPOLL;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'w':
+      opts.n_workers = atoi(optarg);
+      break;
+    case 'd':
+      if (strcmp(optarg, "host") == 0) {
+        opts.distribution = DISTRIBUTE_HOST;
+      } else if (strcmp(optarg, "least") == 0) {
+        opts.distribution = DISTRIBUTE_LEAST_LOADED;
+      } else {
+        usage(argv[0]);
+      }
+      break;
+    case 'c':
+      opts.cache_path = optarg;
+      break;
+    case 'C':
+      opts.http_cache_dir = optarg;
+      break;
+    case 'D':
+      opts.disk_budget = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'T':
+      opts.trace_path = optarg;
+      break;
+    case 'b':
+      opts.batch_path = optarg;
+      break;
+    case 'r':
+      opts.framed = true;
+      break;
+    case 's':
+      opts.spill_threshold = (size_t)strtoul(optarg, NULL, 10) << 20;
+      break;
+    case 'p':
+      opts.max_host_connections = atoi(optarg);
+      break;
+    case 't':
+      opts.max_connections = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  /* 0 disables spilling */
+  if (opts.spill_threshold == 0) {
+    opts.spill_threshold = SIZE_MAX;
+  }
+
+  if (opts.max_in_flight <= 0 || opts.max_fps <= 0 || opts.n_workers <= 0 ||
+      opts.max_host_connections < 0 || opts.max_connections < 0 ||
+      (opts.framed && !opts.batch_path)) {
+    usage(argv[0]);
+  }
+
+  struct global_state state;
+  init_state(&state, &opts);
+
+  int status = EXIT_SUCCESS;
+
+  if (opts.batch_path) {
+    status = run_batch(&state);
+  } else {
+    run_ui(&state);
+  }
+
+  struct frame *frame = &state.frame;
+
+  if (frame->n_frames > 0) {
+    fprintf(stderr,
+            "%zu frames, %.1f bytes/frame (max %zu), %.2f writes/frame\n",
+            frame->n_frames, (double)frame->n_bytes / frame->n_frames,
+            frame->max_bytes, (double)frame->n_writes / frame->n_frames);
+  }
+
+  struct latency_histogram *latency = &state.latency;
+
+  if (latency->n > 0) {
+    fprintf(stderr,
+            "keypress to frame: %llu samples, p50 %.2f ms, p90 %.2f ms, "
+            "p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+            (unsigned long long)latency->n,
+            latency_percentile(latency, 50) / 1000.0,
+            latency_percentile(latency, 90) / 1000.0,
+            latency_percentile(latency, 99) / 1000.0,
+            latency_percentile(latency, 99.9) / 1000.0,
+            latency->max / 1000.0);
+  }
+
+  uint64_t wire_bytes = state.wire_bytes;
+  uint64_t decoded_bytes = state.decoded_bytes;
+
+  /* Responses served from the HTTP cache are all decoded bytes */
+  if (decoded_bytes > 0) {
+    fprintf(stderr, "%.1f KiB received, %.1f KiB decoded\n",
+            wire_bytes / 1024.0, decoded_bytes / 1024.0);
+  }
+
+  cleanup_state(&state);
+
+  return status;
 }